@@ -48,8 +48,18 @@
 #include <pidgin.h>
 
 /* libc headers */
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 
+/* We want to use the gstdio functions when possible so that non-ASCII
+ * filenames are handled properly on Windows. */
+#if GLIB_CHECK_VERSION(2,6,0)
+#include <glib/gstdio.h>
+#else
+#define g_fopen fopen
+#endif
+
 #define ENHANCED_HISTORY_ID "gtk-plugin_pack-enhanced_history"
 
 #define PREF_ROOT_GPPATH	"/plugins/gtk"
@@ -73,12 +83,234 @@
 #define PREF_IM_VAL			purple_prefs_get_bool(PREF_IM_PATH)
 #define PREF_CHAT_VAL		purple_prefs_get_bool(PREF_CHAT_PATH)
 
-static gboolean _scroll_imhtml_to_end(gpointer data)
+#define RENDER_KEY			"enhanced_history:render"
+
+/* How much history to insert into the conversation at a time */
+#define EH_CHUNK_SIZE		2048
+
+/* Returns the last max bytes of a log, as purple_log_read() would return
+ * them, and sets *size to the length of the whole log.  Logs written by the
+ * html logger are read straight from the end of the file, so a big log costs
+ * no more than the part of it that will be shown. */
+static char *eh_log_read_tail(PurpleLog *log, int max, guint *flags, int *size)
 {
-	GtkIMHtml *imhtml = data;
-	gtk_imhtml_scroll_to_end(GTK_IMHTML(imhtml), FALSE);
-	g_object_unref(G_OBJECT(imhtml));
-	return FALSE;
+	PurpleLogCommonLoggerData *data = log->logger_data;
+	char *history;
+	FILE *fp = NULL;
+	long header, end, len, want;
+	int c, got;
+
+	if (log->logger && log->logger->id && !strcmp(log->logger->id, "html")
+			&& data && data->path)
+		fp = g_fopen(data->path, "rb");
+
+	if (fp) {
+		/* purple_log_read() drops the header line */
+		while ((c = getc(fp)) != EOF && c != '\n')
+			;
+		header = ftell(fp);
+
+		if (c != EOF && header >= 0 && fseek(fp, 0, SEEK_END) == 0
+				&& (end = ftell(fp)) >= header) {
+			/* purple_log_read() also drops every \r, so read further back
+			 * until the tail is long enough without them */
+			want = max;
+			history = NULL;
+			for (;;) {
+				len = MIN(end - header, want);
+				g_free(history);
+				history = g_malloc(len + 1);
+				if (fseek(fp, end - len, SEEK_SET) != 0)
+					break;
+				history[fread(history, 1, len, fp)] = '\0';
+				purple_str_strip_char(history, '\r');
+				got = strlen(history);
+
+				if (got >= max || len == end - header) {
+					/* the \r before the tail are still counted, but then
+					 * the log is over the limit anyway */
+					*size = end - header - (len - got);
+					fclose(fp);
+					*flags = PURPLE_LOG_READ_NO_NEWLINE;
+					return history;
+				}
+				want = len + max - got;
+			}
+
+			g_free(history);
+		}
+
+		fclose(fp);
+	}
+
+	history = purple_log_read(log, (PurpleLogReadFlags *)flags);
+	*size = strlen(history);
+	if (*size > max)
+		g_memmove(history, history + *size - max, max + 1);
+
+	return history;
+}
+
+/* The logs of every buddy in a contact, merged newest first.  Each list from
+ * purple_log_get_logs() is already sorted that way, so a small heap of the
+ * lists, keyed on the time of the next log in each, yields the logs in order
+ * while only looking at the ones that are actually shown. */
+typedef struct {
+	GList **heap;	/* the rest of each non-empty list */
+	int n;
+	GSList *lists;	/* every list, to free them afterwards */
+} EHLogMerge;
+
+#define EH_LOG_TIME(l) (((PurpleLog *)(l)->data)->time)
+
+static void eh_merge_sift_down(EHLogMerge *merge, int i)
+{
+	GList *tmp;
+	int child;
+
+	while ((child = 2 * i + 1) < merge->n) {
+		if (child + 1 < merge->n
+				&& EH_LOG_TIME(merge->heap[child + 1]) > EH_LOG_TIME(merge->heap[child]))
+			child++;
+		if (EH_LOG_TIME(merge->heap[child]) <= EH_LOG_TIME(merge->heap[i]))
+			break;
+		tmp = merge->heap[i];
+		merge->heap[i] = merge->heap[child];
+		merge->heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void eh_merge_add(EHLogMerge *merge, GList *logs)
+{
+	int i;
+
+	if (!logs)
+		return;
+
+	merge->lists = g_slist_prepend(merge->lists, logs);
+	merge->heap = g_renew(GList *, merge->heap, merge->n + 1);
+
+	/* sift up */
+	for (i = merge->n++; i > 0 && EH_LOG_TIME(logs) > EH_LOG_TIME(merge->heap[(i - 1) / 2]);
+			i = (i - 1) / 2)
+		merge->heap[i] = merge->heap[(i - 1) / 2];
+	merge->heap[i] = logs;
+}
+
+/* Returns the newest log not returned yet, or NULL when there are none left. */
+static PurpleLog *eh_merge_next(EHLogMerge *merge)
+{
+	PurpleLog *log;
+
+	if (merge->n == 0)
+		return NULL;
+
+	log = merge->heap[0]->data;
+	merge->heap[0] = merge->heap[0]->next;
+	if (!merge->heap[0])
+		merge->heap[0] = merge->heap[--merge->n];
+	eh_merge_sift_down(merge, 0);
+
+	return log;
+}
+
+static void eh_merge_free(EHLogMerge *merge)
+{
+	GSList *l;
+
+	for (l = merge->lists; l; l = l->next) {
+		g_list_foreach(l->data, (GFunc)purple_log_free, NULL);
+		g_list_free(l->data);
+	}
+	g_slist_free(merge->lists);
+	g_free(merge->heap);
+}
+
+/* One log, with its header, in the history buffer */
+typedef struct {
+	gsize offset;
+	GtkIMHtmlOptions options;
+	const char *protocol;
+} EHSegment;
+
+/* History that is still being inserted into a conversation.  It goes in a
+ * chunk of lines at a time from an idle callback, newest first, each chunk
+ * above the previous one, so the window is usable while it streams in. */
+typedef struct {
+	PurpleConversation *conv;
+	GString *buffer;
+	GArray *segments;	/* of EHSegment, newest first */
+	guint seg;			/* the segment being inserted */
+	gsize end;			/* the end of what is left of it */
+	guint source;
+} EHRender;
+
+static void eh_render_free(EHRender *render)
+{
+	if (render->source)
+		g_source_remove(render->source);
+	purple_conversation_set_data(render->conv, RENDER_KEY, NULL);
+	g_array_free(render->segments, TRUE);
+	g_string_free(render->buffer, TRUE);
+	g_free(render);
+}
+
+static gboolean eh_render_chunk(gpointer data)
+{
+	EHRender *render = data;
+	GtkIMHtml *imhtml = GTK_IMHTML(PIDGIN_CONVERSATION(render->conv)->imhtml);
+	GtkAdjustment *adj = GTK_TEXT_VIEW(imhtml)->vadjustment;
+	EHSegment *seg = &g_array_index(render->segments, EHSegment, render->seg);
+	GtkTextIter start;
+	char *str = render->buffer->str, *protocol;
+	gboolean at_end;
+	gsize begin;
+
+	/* Take the last lines of what is left of this log */
+	begin = render->end - seg->offset > EH_CHUNK_SIZE ? render->end - EH_CHUNK_SIZE : seg->offset;
+	while (begin > seg->offset && str[begin - 1] != '\n')
+		begin--;
+
+	at_end = adj->value >= adj->upper - adj->page_size;
+
+	/* Set the correct protocol_name for this log, and put back the one the
+	   conversation uses afterwards */
+	protocol = g_strdup(gtk_imhtml_get_protocol_name(imhtml));
+	gtk_imhtml_set_protocol_name(imhtml, seg->protocol);
+
+	gtk_text_buffer_get_iter_at_offset(imhtml->text_buffer, &start, 0);
+	gtk_imhtml_insert_html_at_iter(imhtml, str + begin, seg->options, &start);
+
+	gtk_imhtml_set_protocol_name(imhtml, protocol);
+	g_free(protocol);
+
+	if (at_end)
+		gtk_imhtml_scroll_to_end(imhtml, FALSE);
+
+	/* The next chunk ends where this one started */
+	str[begin] = '\0';
+	render->end = begin;
+
+	if (begin == seg->offset) {
+		if (++render->seg == render->segments->len) {
+			render->source = 0;
+			eh_render_free(render);
+			return FALSE;
+		}
+		seg++;
+		render->end = seg->offset + strlen(str + seg->offset);
+	}
+
+	return TRUE;
+}
+
+static void eh_render_cancel(PurpleConversation *c)
+{
+	EHRender *render = purple_conversation_get_data(c, RENDER_KEY);
+
+	if (render)
+		eh_render_free(render);
 }
 
 static void historize(PurpleConversation *c)
@@ -86,14 +318,18 @@ static void historize(PurpleConversation *c)
 	PurpleAccount *account = NULL;
 	PurpleConversationType convtype;
 	PidginConversation *gtkconv = NULL;
-	GtkTextIter start;
 	GtkIMHtmlOptions options;
-	GList *logs = NULL, *logs_head = NULL;
+	EHLogMerge merge = { NULL, 0, NULL };
+	PurpleLog *log;
+	GString *buffer;
+	GArray *segments;
+	EHSegment segment;
+	EHRender *render;
 	struct tm *log_tm = NULL, *local_tm = NULL;
 	time_t t, log_time;
 	double limit_time = 0.0;
 	const char *name = NULL, *alias = NULL, *LOG_MODE = NULL;
-	char *header = NULL, *protocol = NULL, *history = NULL;
+	char *history = NULL;
 	int conv_counter = 0;
 	int limit_offset = 0;
 	int byte_counter = 0;
@@ -144,9 +380,9 @@ static void historize(PurpleConversation *c)
 				PurpleBlistNode *node2;
 
 				for(node2 = node->parent->child; node2; node2 = node2->next) {
-					logs = g_list_concat(purple_log_get_logs(PURPLE_LOG_IM,
+					eh_merge_add(&merge, purple_log_get_logs(PURPLE_LOG_IM,
 								purple_buddy_get_name((PurpleBuddy *)node2),
-								purple_buddy_get_account((PurpleBuddy *)node2)), logs);
+								purple_buddy_get_account((PurpleBuddy *)node2)));
 				}
 
 				break;
@@ -155,25 +391,22 @@ static void historize(PurpleConversation *c)
 
 		g_slist_free(buddies);
 
-		if (logs)
-			logs = g_list_sort(logs, purple_log_compare);
-		else
-			logs = purple_log_get_logs(PURPLE_LOG_IM, name, account);
+		if (merge.n == 0)
+			eh_merge_add(&merge, purple_log_get_logs(PURPLE_LOG_IM, name, account));
 	} else if (convtype == PURPLE_CONV_TYPE_CHAT && PREF_CHAT_VAL) {
-		logs = purple_log_get_logs(PURPLE_LOG_CHAT,
-			purple_conversation_get_name(c), purple_conversation_get_account(c));
+		eh_merge_add(&merge, purple_log_get_logs(PURPLE_LOG_CHAT,
+			purple_conversation_get_name(c), purple_conversation_get_account(c)));
 	}
 
 	gtkconv = PIDGIN_CONVERSATION(c);
 
 	/* The logs are non-existant or the user has disabled this type for log displaying. */
-	if (!logs) {
+	log = eh_merge_next(&merge);
+	if (!log) {
+		eh_merge_free(&merge);
 		return;
 	}
 
-	/* Keep a pointer to the head of the logs for freeing later */
-	logs_head = logs;
-
 	/* If all time prefs are not 0, prepare to check times */
 	if (!(PREF_MINS_VAL == 0 && PREF_HOURS_VAL == 0 && PREF_DAYS_VAL == 0)) {
 		check_time = 1;
@@ -187,24 +420,25 @@ static void historize(PurpleConversation *c)
 				(PREF_DAYS_VAL * 60.0 * 60.0 * 24.0);
 	}
 
-	/* The protocol will need to be adjusted for each log for correct display,
-	   so save the current imhtml protocol_name to restore it later */
-	protocol = g_strdup(gtk_imhtml_get_protocol_name(GTK_IMHTML(gtkconv->imhtml)));
+	/* All the shown logs go into one buffer, newest first, with room for the
+	   byte limit and a header for each log */
+	buffer = g_string_sized_new(PREF_BYTES_VAL + PREF_NUMBER_VAL * 128);
+	segments = g_array_sized_new(FALSE, FALSE, sizeof(EHSegment), PREF_NUMBER_VAL);
 
 	/* Calculate time for the first log */
-	log_tm = gmtime(&((PurpleLog*)logs->data)->time);
+	log_tm = gmtime(&log->time);
 	log_time = mktime(log_tm);
 
 	/* Continue to add older logs until they run out or the conditions are no
 	   longer met */
-	while (logs && conv_counter < PREF_NUMBER_VAL
+	while (log && conv_counter < PREF_NUMBER_VAL
 			&& byte_counter < PREF_BYTES_VAL
 			&& (!check_time || difftime(t, log_time) < limit_time)) {
 		guint flags;
 
-		/* Get the current log's contents as a char* */
-		history = purple_log_read((PurpleLog*)logs->data, &flags);
-		log_size = strlen(history);
+		/* Get as much of the end of the current log as can still be shown */
+		history = eh_log_read_tail(log, PREF_BYTES_VAL - byte_counter,
+				&flags, &log_size);
 
 		if (flags & PURPLE_LOG_READ_NO_NEWLINE)
 			options |= GTK_IMHTML_NO_NEWLINE;
@@ -215,14 +449,15 @@ static void historize(PurpleConversation *c)
 		byte_counter += log_size;
 		overshoot = byte_counter - PREF_BYTES_VAL;
 		if (overshoot > 0) {
-			/* Start looking at the maximum log size for a newline to break at */
-			limit_offset = overshoot;
+			/* Only the part of the log that fits was read, so start looking
+			 * at its beginning for a newline to break at */
+			limit_offset = 0;
 			/* Find the next \n, or stop if the end of the log is reached */
 			while (history[limit_offset] && history[limit_offset] != '\n') {
 				limit_offset++;
 			}
 			/* If we're at or very close to the end of the log, forget this log */
-			if (!history[limit_offset] || (log_size - limit_offset < 3)) {
+			if (!history[limit_offset] || (strlen(history) - limit_offset < 3)) {
 				limit_offset = -1;
 			}
 			else {
@@ -235,26 +470,20 @@ static void historize(PurpleConversation *c)
 
 		/* If this log won't fit at all, don't display it in the conversation */
 		if (limit_offset != -1) {
-			/* Set the correct protocol_name for this log */
-			gtk_imhtml_set_protocol_name(GTK_IMHTML(gtkconv->imhtml),
-					purple_account_get_protocol_name(((PurpleLog*)logs->data)->account));
+			segment.offset = buffer->len;
+			segment.options = options;
+			segment.protocol = purple_account_get_protocol_name(log->account);
 
-			/* Prepend the contents of the log starting at the calculated offset */
-			gtk_text_buffer_get_iter_at_offset(GTK_IMHTML(gtkconv->imhtml)->text_buffer,
-					&start, 0);
-			gtk_imhtml_insert_html_at_iter(GTK_IMHTML(gtkconv->imhtml),
-						history + limit_offset, options, &start);
-
-			/* Prepend the conversation header */
+			/* The conversation header goes above the log */
 			if (PREF_DATES_VAL) {
-				header = g_strdup_printf(_("<b>Conversation with %s on %s:</b><br>"), alias,
-					purple_date_format_full(localtime(&((PurpleLog *)logs->data)->time)));
-				gtk_text_buffer_get_iter_at_offset(GTK_IMHTML(gtkconv->imhtml)->text_buffer,
-						&start, 0);
-				gtk_imhtml_insert_html_at_iter(GTK_IMHTML(gtkconv->imhtml),
-						header, options, &start);
-				g_free(header);
+				g_string_append_printf(buffer, _("<b>Conversation with %s on %s:</b><br>"),
+					alias, purple_date_format_full(localtime(&log->time)));
 			}
+
+			/* followed by the log starting at the calculated offset */
+			g_string_append(buffer, history + limit_offset);
+			g_string_append_c(buffer, '\0');
+			g_array_append_val(segments, segment);
 		}
 
 		g_free(history);
@@ -264,28 +493,34 @@ static void historize(PurpleConversation *c)
 			break;
 		}
 
-		logs = logs->next;
+		log = eh_merge_next(&merge);
 
 		/* Recalculate log time if we haven't run out of logs */
-		if (logs) {
-			log_tm = gmtime(&((PurpleLog*)logs->data)->time);
+		if (log) {
+			log_tm = gmtime(&log->time);
 			log_time = mktime(log_tm);
 		}
 	}
 
+	/* The history goes above this line, and new messages below it */
 	gtk_imhtml_append_text(GTK_IMHTML(gtkconv->imhtml), "<hr>", options);
+	gtk_imhtml_scroll_to_end(GTK_IMHTML(gtkconv->imhtml), FALSE);
+
+	if (segments->len > 0) {
+		render = g_new0(EHRender, 1);
+		render->conv = c;
+		render->buffer = buffer;
+		render->segments = segments;
+		render->end = strlen(buffer->str);
+		render->source = g_idle_add(eh_render_chunk, render);
+		purple_conversation_set_data(c, RENDER_KEY, render);
+	} else {
+		g_array_free(segments, TRUE);
+		g_string_free(buffer, TRUE);
+	}
 
-	/* Restore the original protocol_name */
-	gtk_imhtml_set_protocol_name(GTK_IMHTML(gtkconv->imhtml), protocol);
-	g_free(protocol);
-	
-	g_object_ref(G_OBJECT(gtkconv->imhtml));
-	g_idle_add(_scroll_imhtml_to_end, gtkconv->imhtml);
-	
 	/* Clear the allocated memory that the logs are using */
-	g_list_foreach(logs_head, (GFunc)purple_log_free, NULL);
-	g_list_free(logs_head);
-	
+	eh_merge_free(&merge);
 }
 
 static gboolean
@@ -293,6 +528,19 @@ plugin_load(PurplePlugin *plugin)
 {
 	purple_signal_connect(purple_conversations_get_handle(),
 			"conversation-created", plugin, PURPLE_CALLBACK(historize), NULL);
+	purple_signal_connect(purple_conversations_get_handle(),
+			"deleting-conversation", plugin, PURPLE_CALLBACK(eh_render_cancel), NULL);
+
+	return TRUE;
+}
+
+static gboolean
+plugin_unload(PurplePlugin *plugin)
+{
+	GList *convs;
+
+	for (convs = purple_get_conversations(); convs; convs = convs->next)
+		eh_render_cancel(convs->data);
 
 	return TRUE;
 }
@@ -369,7 +617,7 @@ static PurplePluginInfo info =
 	PP_WEBSITE,
 
 	plugin_load,
-	NULL,
+	plugin_unload,
 	NULL, 
 
 	&ui_info,
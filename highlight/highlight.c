@@ -35,14 +35,32 @@
 
 #define PREF_PREFIX "/plugins/core/highlight"
 #define PREF_WORDS PREF_PREFIX "/words"
+#define PREF_HISTORY_LIMIT PREF_PREFIX "/history_limit"
 
 #define DELIMS " \t.,;|<>?/\\`~!@#$%^&*()+={}[]:'\""
 
 #define PROP     "highlight-words"
 
-static char **words;
 static PurpleCmdId cmd;
 
+/**
+ * The highlight words, casefolded, in a trie over their UTF-8 bytes.
+ * Node 0 is the root. Messages are matched against it a character at a
+ * time, without copying or folding them first.
+ */
+typedef struct
+{
+	guint child;     /* first child, 0 if none */
+	guint sibling;   /* next child of the same parent, 0 if none */
+	guchar byte;
+	gboolean word;   /* a highlight word ends here */
+} TrieNode;
+
+#define TRIE_DEAD G_MAXUINT
+
+static TrieNode *trie;
+static guint trie_size;
+
 /**
  * History stuff.
  */
@@ -51,19 +69,131 @@ static PurpleCmdId cmd;
  */
 static GHashTable *history;
 
+/* One highlighted message. Its strings live in the owning History's text. */
+typedef struct
+{
+	time_t mtime;
+	gsize who;       /* offsets into History.text */
+	gsize message;
+} HistoryEntry;
+
+/* The last few highlights of a conversation, in a ring, oldest first. */
+typedef struct
+{
+	HistoryEntry *entries;
+	guint size;      /* length of entries */
+	guint first;     /* the oldest entry */
+	guint count;
+	GString *text;   /* who and message of each entry, NUL-terminated */
+	gsize live;      /* bytes of text still used by some entry */
+} History;
+
 static void
-string_destroy(gpointer data)
+history_destroy(gpointer data)
 {
-	g_string_free(data, TRUE);
+	History *h = data;
+
+	g_free(h->entries);
+	g_string_free(h->text, TRUE);
+	g_free(h);
+}
+
+static HistoryEntry *
+history_nth(History *h, guint n)
+{
+	return &h->entries[(h->first + n) % h->size];
+}
+
+static gsize
+history_entry_len(History *h, HistoryEntry *e)
+{
+	return e->message - e->who + strlen(h->text->str + e->message) + 1;
+}
+
+/* Drop the text of the entries that fell out of the ring, once that is
+ * most of it, so the text stays within a small multiple of the live size. */
+static void
+history_compact(History *h)
+{
+	GString *text;
+	HistoryEntry *e;
+	gsize len;
+	guint i;
+
+	if (h->live > h->text->len / 2)
+		return;
+
+	text = g_string_sized_new(h->live);
+	for (i = 0; i < h->count; i++) {
+		e = history_nth(h, i);
+		len = history_entry_len(h, e);
+		e->message = e->message - e->who + text->len;
+		g_string_append_len(text, h->text->str + e->who, len);
+		e->who = text->len - len;
+	}
+	g_string_free(h->text, TRUE);
+	h->text = text;
+}
+
+/* Shrink or grow the ring to the configured limit, keeping the newest. */
+static void
+history_resize(History *h, guint size)
+{
+	HistoryEntry *entries;
+	guint i;
+
+	while (h->count > size) {
+		h->live -= history_entry_len(h, history_nth(h, 0));
+		h->first = (h->first + 1) % h->size;
+		h->count--;
+	}
+
+	entries = g_new(HistoryEntry, size);
+	for (i = 0; i < h->count; i++)
+		entries[i] = *history_nth(h, i);
+	g_free(h->entries);
+	h->entries = entries;
+	h->size = size;
+	h->first = 0;
+
+	history_compact(h);
+}
+
+static guint
+history_limit()
+{
+	return MAX(purple_prefs_get_int(PREF_HISTORY_LIMIT), 1);
+}
+
+static void
+resize_one_history(gpointer key, gpointer value, gpointer data)
+{
+	history_resize(value, GPOINTER_TO_UINT(data));
+}
+
+static void
+history_limit_changed(const char *name, PurplePrefType type, gconstpointer val, gpointer data)
+{
+	g_hash_table_foreach(history, resize_one_history, GUINT_TO_POINTER(history_limit()));
 }
 
 static void
 print_history_from_one_conv(gpointer key, gpointer value, gpointer data)
 {
-	g_string_append_printf(data, "<b>Highlights from %s (%s)<br>%s<br><br><hr>",
+	History *h = value;
+	HistoryEntry *e;
+	guint i;
+
+	g_string_append_printf(data, "<b>Highlights from %s (%s)<br>",
 			purple_conversation_get_name(key),
-			purple_account_get_username(purple_conversation_get_account(key)),
-			((GString*)value)->str);
+			purple_account_get_username(purple_conversation_get_account(key)));
+	for (i = 0; i < h->count; i++) {
+		e = history_nth(h, i);
+		g_string_append_printf(data, "<br>(%s) <b>%s</b>: %s",
+				purple_time_format(localtime(&e->mtime)),
+				h->text->str + e->who, h->text->str + e->message);
+	}
+	g_string_append(data, "<br><br><hr>");
 }
 
 static void
@@ -73,79 +203,144 @@ print_history()
 	g_hash_table_foreach(history, print_history_from_one_conv, str);
 	purple_notify_formatted(NULL, _("Highlight History"), _("Highlight History"),
 			NULL, str->str, NULL, NULL);
-	string_destroy(str);
+	g_string_free(str, TRUE);
 }
 
 static void
 clear_history()
 {
 	g_hash_table_destroy(history);
-	history = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, string_destroy);
+	history = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, history_destroy);
 }
 
 static void
 add_to_history(PurpleConversation *conv, const char *message, const char *who, time_t mtime)
 {
-	GString *str = g_hash_table_lookup(history, conv);
-	if (str == NULL) {
-		str = g_string_new(NULL);
-		g_hash_table_replace(history, conv, str);
+	History *h = g_hash_table_lookup(history, conv);
+	HistoryEntry *e;
+	gsize start;
+
+	if (h == NULL) {
+		h = g_new0(History, 1);
+		h->text = g_string_new(NULL);
+		history_resize(h, history_limit());
+		g_hash_table_replace(history, conv, h);
 	}
-	g_string_append_printf(str, "<br>(%s) <b>%s</b>: %s",
-			purple_time_format(localtime(&mtime)),
-			who, message);
+
+	if (h->count == h->size) {
+		h->live -= history_entry_len(h, history_nth(h, 0));
+		h->first = (h->first + 1) % h->size;
+		h->count--;
+		history_compact(h);
+	}
+
+	start = h->text->len;
+	e = history_nth(h, h->count++);
+	e->mtime = mtime;
+	e->who = start;
+	g_string_append_len(h->text, who, strlen(who) + 1);
+	e->message = h->text->len;
+	g_string_append_len(h->text, message, strlen(message) + 1);
+	h->live += h->text->len - start;
 }
 
 /* End of history */
 
-static void
-casefold_collate_strings(char **string)
+/* words are separated by DELIMS, or by any non-ASCII space or punctuation */
+static gboolean
+is_boundary(gunichar c)
 {
-	int i;
-
-	for (i = 0; string[i]; i++) {
-		char *store = string[i];
-		char *cs = g_utf8_casefold(store, -1);
-		string[i] = g_utf8_collate_key(cs, -1);
-		g_free(cs);
-		g_free(store);
-	}
+	if (c < 0x80)
+		return c == 0 || strchr(DELIMS, c) != NULL;
+	return g_unichar_isspace(c) || g_unichar_ispunct(c);
 }
 
-static void
-sort(char **strings, int length)
+static guint
+trie_step(guint node, guchar byte)
 {
-	int half;
-	char **left, **middle, **m, **right;
-	char **ret, **r;
+	guint n;
 
-	if (length <= 1)
-		return;
+	for (n = trie[node].child; n != 0; n = trie[n].sibling)
+		if (trie[n].byte == byte)
+			return n;
+	return TRIE_DEAD;
+}
+
+static guint
+trie_add(guint node, guchar byte)
+{
+	guint n = trie_step(node, byte);
+
+	if (n != TRIE_DEAD)
+		return n;
 
-	r = ret = g_new0(char *, length);
+	trie = g_renew(TrieNode, trie, trie_size + 1);
+	n = trie_size++;
+	trie[n].child = 0;
+	trie[n].byte = byte;
+	trie[n].word = FALSE;
+	trie[n].sibling = trie[node].child;
+	trie[node].child = n;
 
-	half = length / 2;
-	sort(strings, half);
-	sort(strings + half, length - half);
+	return n;
+}
+
+/* Walk the next character of a word down the trie. Characters are folded
+ * one at a time with g_unichar_tolower(), the same way for the words and
+ * for messages. */
+static guint
+trie_feed(guint node, gunichar c, gboolean add)
+{
+	char buf[6];
+	int i, len;
+
+	len = g_unichar_to_utf8(g_unichar_tolower(c), buf);
+	for (i = 0; i < len && node != TRIE_DEAD; i++)
+		node = add ? trie_add(node, buf[i]) : trie_step(node, buf[i]);
+
+	return node;
+}
 
-	left = strings;
-	middle = m = strings + half;
-	right = strings + length;
+/* Does any word of text match? With add, put every word of text in the
+ * trie instead. */
+static gboolean
+trie_scan(const char *text, gboolean add)
+{
+	const char *p = text;
+	guint node = 0;
+	gboolean in_word = FALSE;
+	gunichar c;
+	int step;
+
+	for (;;) {
+		c = g_utf8_get_char_validated(p, -1);
+		if (c == (gunichar)-1 || c == (gunichar)-2) {
+			c = (guchar)*p;    /* not UTF-8, take the byte for what it is */
+			step = 1;
+		} else
+			step = g_utf8_next_char(p) - p;
+
+		if (is_boundary(c)) {
+			if (in_word && node != TRIE_DEAD) {
+				if (add)
+					trie[node].word = TRUE;
+				else if (trie[node].word)
+					return TRUE;
+			}
+			node = 0;
+			in_word = FALSE;
+		} else {
+			in_word = TRUE;
+			if (node != TRIE_DEAD)
+				node = trie_feed(node, c, add);
+		}
 
-	while (left < middle && m < right) {
-		int comp = strcmp(*left, *m);
-		if (comp <= 0)
-			*r++ = *left++;
-		else
-			*r++ = *m++;
+		if (*p == '\0')
+			break;
+		p += step;
 	}
-	while (left < middle)
-		*r++ = *left++;
-	while (m < right)
-		*r++ = *m++;
-	for (half = 0; half < length; half++)
-		strings[half] = ret[half];
-	g_free(ret);
+
+	return FALSE;
 }
 
 static gboolean
@@ -161,59 +356,31 @@ static gboolean
 msg_callback(PurpleAccount *account, char **who, char **message, PurpleConversation *conv,
 		PurpleMessageFlags *flags)
 {
-	char **splits;
-	int len;
-	int wl, sl;
 	const char *me;
 
 	if (*flags & PURPLE_MESSAGE_NICK) {
 		return FALSE;     /* this message is already highlighted */
 	}
 
-	if (!words)
+	if (trie == NULL || trie[0].child == 0)
 		return FALSE;
 
 	me = purple_connection_get_display_name(purple_account_get_connection(account));
 	if (me != NULL && g_utf8_collate(*who, me) == 0)
 		return FALSE;
 
-	splits = g_strsplit_set(*message, DELIMS, -1);
-	if (!splits)
-		return FALSE;
-	len = 0;
-	while (splits[len])
-		len++;
-	casefold_collate_strings(splits);
-	sort(splits, len);
-
-	/* this is probably over-engineering. */
-	for (sl = 0, wl = 0; words[wl] && splits[sl]; ) {
-		int val = strcmp(words[wl], splits[sl]);
-		if (val == 0) {
-			*flags |= PURPLE_MESSAGE_NICK;
-			break;
-		}
-		if (val < 0)
-			wl++;
-		else
-			sl++;
-	}
-	g_strfreev(splits);
+	if (trie_scan(*message, FALSE))
+		*flags |= PURPLE_MESSAGE_NICK;
 	return FALSE;
 }
 
 static void
 construct_list()
 {
-	int len = 0;
-	g_strfreev(words);
-	words = g_strsplit_set(purple_prefs_get_string(PREF_WORDS), DELIMS, -1);
-	if (!words)
-		return;
-	while (words[len])
-		len++;
-	casefold_collate_strings(words);
-	sort(words, len);
+	g_free(trie);
+	trie = g_new0(TrieNode, 1);
+	trie_size = 1;
+	trie_scan(purple_prefs_get_string(PREF_WORDS), TRUE);
 }
 
 static PurpleCmdRet
@@ -251,7 +418,8 @@ plugin_load(PurplePlugin *plugin)
 			  "/highlight -&lt;word&gt;:  removes &lt;word&gt; from the highlight word list for this conversation only.\n"),
 			NULL);
 
-	history = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, string_destroy);
+	history = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, history_destroy);
+	purple_prefs_connect_callback(plugin, PREF_HISTORY_LIMIT, history_limit_changed, NULL);
 	return TRUE;
 #endif
 }
@@ -262,6 +430,8 @@ plugin_unload(PurplePlugin *plugin)
 	if (cmd)
 		purple_cmd_unregister(cmd);
 	g_hash_table_destroy(history);
+	g_free(trie);
+	trie = NULL;
 	return TRUE;
 }
 
@@ -277,6 +447,11 @@ get_plugin_pref_frame(PurplePlugin *plugin)
 						"(separate words by space)"));
 	purple_plugin_pref_frame_add(frame, pref);
 
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_HISTORY_LIMIT,
+						_("Highlights to remember per conversation"));
+	purple_plugin_pref_set_bounds(pref, 1, 10000);
+	purple_plugin_pref_frame_add(frame, pref);
+
 	return frame;
 }
 
@@ -329,6 +504,7 @@ init_plugin(PurplePlugin *plugin)
 #endif /* ENABLE_NLS */
 	purple_prefs_add_none(PREF_PREFIX);
 	purple_prefs_add_string(PREF_WORDS, "");
+	purple_prefs_add_int(PREF_HISTORY_LIMIT, 100);
 
 	info.name = _("Highlight");
 	info.summary = _("Support for highlighting words.");
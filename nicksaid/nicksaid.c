@@ -32,6 +32,10 @@
 #define PREF_DATESTAMP		PREF_PREFIX "/datestamp"
 #define PREF_SHOWWHO		PREF_PREFIX "/showwho"
 #define PREF_SHOWALL		PREF_PREFIX "/showall"
+#define PREF_LIMIT			PREF_PREFIX "/limit"
+
+#define NS_NAME_LEN			64	/* bytes kept of the speaker's name */
+#define NS_TEXT_LEN			40	/* bytes kept of the message, the most PREF_CHARS allows */
 
 /* System headers */
 #include <string.h>
@@ -70,42 +74,47 @@ typedef struct _NickSaid NickSaid;
 struct _NickSaid
 {
 	int offset;
-	char *who;
-	char *what;
+	time_t when;
+	char name[NS_NAME_LEN + 1];
+	char text[NS_TEXT_LEN + 1];	/* start of the message, without markup */
+	char *what;					/* the whole message, only with PREF_SHOWALL */
 };
 
+/* The last few mentions in a conversation, kept in a ring. */
+typedef struct
+{
+	NickSaid *said;
+	guint size;
+	guint first;	/* the oldest */
+	guint count;
+} NickSaidRing;
+
 /* <lift src="pidgin/src/util.c"> ??? */
 static const gchar *
-ns_time(void)
+ns_time(time_t tme)
 {
 	static gchar buf[80];
-	time_t tme;
 
-	time(&tme);
 	strftime(buf, sizeof(buf), "%H:%M:%S", localtime(&tme));
 
 	return buf;
 }
 
 static const gchar *
-ns_date(void)
+ns_date(time_t tme)
 {
 	static gchar buf[80];
-	time_t tme;
 
-	time(&tme);
 	strftime(buf, sizeof(buf), "%Y-%m-%d", localtime(&tme));
 
 	return buf;
 }
 
 static const gchar *
-ns_date_full(void)
+ns_date_full(time_t tme)
 {
 	gchar *buf;
-	time_t tme;
 
-	time(&tme);
 	buf = ctime(&tme);
 	buf[strlen(buf) - 1] = '\0';
 
@@ -113,6 +122,97 @@ ns_date_full(void)
 }
 /* <lift/> */
 
+/* Copy at most len bytes of src into dest, without splitting a character. */
+static void
+ns_copy(char *dest, const char *src, gsize len)
+{
+	const char *end;
+
+	g_strlcpy(dest, src, len + 1);
+	if (!g_utf8_validate(dest, -1, &end))
+		dest[end - dest] = '\0';
+}
+
+static NickSaid *
+ns_ring_nth(NickSaidRing *ring, guint n)
+{
+	return &ring->said[(ring->first + n) % ring->size];
+}
+
+static void
+ns_ring_drop_oldest(NickSaidRing *ring)
+{
+	NickSaid *said = ns_ring_nth(ring, 0);
+
+	g_free(said->what);
+	said->what = NULL;
+	ring->first = (ring->first + 1) % ring->size;
+	ring->count--;
+}
+
+static void
+ns_ring_free(NickSaidRing *ring)
+{
+	while (ring->count)
+		ns_ring_drop_oldest(ring);
+	g_free(ring->said);
+	g_free(ring);
+}
+
+/* Make room for size mentions, keeping the newest ones. */
+static void
+ns_ring_resize(NickSaidRing *ring, guint size)
+{
+	NickSaid *said;
+	guint i;
+
+	while (ring->count > size)
+		ns_ring_drop_oldest(ring);
+
+	said = g_new0(NickSaid, size);
+	for (i = 0; i < ring->count; i++)
+		said[i] = *ns_ring_nth(ring, i);
+	g_free(ring->said);
+	ring->said = said;
+	ring->size = size;
+	ring->first = 0;
+}
+
+/* The "(time) " prefix of a mention, as the prefs want it, or NULL. */
+static char *
+ns_prefix(NickSaid *said)
+{
+	gboolean timestamp = purple_prefs_get_bool(PREF_TIMESTAMP);
+	gboolean datestamp = purple_prefs_get_bool(PREF_DATESTAMP);
+
+	if (datestamp && timestamp)
+		return g_strdup_printf("(%s) ", ns_date_full(said->when));
+	else if (datestamp && !timestamp)
+		return g_strdup_printf("(%s) ", ns_date(said->when));
+	else if (!datestamp && timestamp)
+		return g_strdup_printf("(%s) ", ns_time(said->when));
+	return NULL;
+}
+
+/* The label of a mention in the nicksaid menu. */
+static char *
+ns_label(NickSaid *said)
+{
+	char text[NS_TEXT_LEN + 1];
+	char *prefix, *label;
+
+	ns_copy(text, said->text, CLAMP(purple_prefs_get_int(PREF_CHARS), 0, NS_TEXT_LEN));
+	prefix = ns_prefix(said);
+
+	if (purple_prefs_get_bool(PREF_SHOWWHO))
+		label = g_strdup_printf("%s%s: %s", prefix ? prefix : "", said->name, text);
+	else
+		label = g_strdup_printf("%s%s", prefix ? prefix : "", text);
+
+	g_free(prefix);
+	return label;
+}
+
 struct _callbackdata
 {
 	GtkTextView *view;
@@ -199,34 +299,27 @@ go_selected(GtkWidget *w, PidginConversation *gtkconv)
 static void
 clear_list(GtkWidget *w, PidginConversation *gtkconv)
 {
-	GList *ll, *list;
-
-	ll = list = g_object_get_data(G_OBJECT(gtkconv->imhtml), "nicksaid:list");
-
-	while (list)
-	{
-		NickSaid *said = list->data;
-		g_free(said->who);
-		g_free(said->what);
-		g_free(said);
-		list = list->next;
-	}
-	g_list_free(ll);
-
 	g_object_set_data(G_OBJECT(gtkconv->imhtml), "nicksaid:list", NULL);
 }
 
 static void
 show_all(GtkWidget *w, PidginConversation *gtkconv)
 {
-	GList *list = g_object_get_data(G_OBJECT(gtkconv->imhtml), "nicksaid:list");
+	NickSaidRing *ring = g_object_get_data(G_OBJECT(gtkconv->imhtml), "nicksaid:list");
 	GString *str = g_string_new(NULL);
+	guint i;
 
-	while (list)
+	for (i = ring ? ring->count : 0; i-- > 0;)
 	{
-		NickSaid *said = list->data;
-		g_string_append_printf(str, "%s<br/>\n", said->what);
-		list = list->next;
+		NickSaid *said = ns_ring_nth(ring, i);
+		char *prefix;
+
+		if (said->what == NULL)
+			continue;
+		prefix = ns_prefix(said);
+		g_string_append_printf(str, "%s<b>%s: </b>%s<br/>\n",
+				prefix ? prefix : "", said->name, said->what);
+		g_free(prefix);
 	}
 
 	purple_notify_formatted(gtkconv, _("Nicksaid"), _("List of highlighted messages:"),
@@ -240,7 +333,8 @@ generate_popup(GtkWidget *w, GdkEventButton *event, PidginWindow *win)
 	GtkWidget *menu, *item;
 	PurpleConversation *conv;
 	PidginConversation *gtkconv;
-	GList *list;
+	NickSaidRing *ring;
+	guint i;
 
 	conv = pidgin_conv_window_get_active_conversation(win);
 	if (purple_conversation_get_type(conv) != PURPLE_CONV_TYPE_CHAT)
@@ -250,8 +344,8 @@ generate_popup(GtkWidget *w, GdkEventButton *event, PidginWindow *win)
 
 	gtkconv = PIDGIN_CONVERSATION(conv);
 
-	list = g_object_get_data(G_OBJECT(gtkconv->imhtml), "nicksaid:list");
-	if (!list)
+	ring = g_object_get_data(G_OBJECT(gtkconv->imhtml), "nicksaid:list");
+	if (!ring || !ring->count)
 	{
 		item = gtk_menu_item_new_with_label(_("None"));
 		gtk_widget_set_sensitive(item, FALSE);
@@ -274,10 +368,12 @@ generate_popup(GtkWidget *w, GdkEventButton *event, PidginWindow *win)
 		pidgin_separator(menu);
 #endif
 
-		while (list)
+		for (i = ring->count; i-- > 0;)
 		{
-			NickSaid *said = list->data;
-			item = gtk_menu_item_new_with_label(said->who);
+			NickSaid *said = ns_ring_nth(ring, i);
+			char *label = ns_label(said);
+			item = gtk_menu_item_new_with_label(label);
+			g_free(label);
 			gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
 			gtk_widget_show(item);
 			g_object_set_data(G_OBJECT(item), "nicksaid:offset",
@@ -286,7 +382,6 @@ generate_popup(GtkWidget *w, GdkEventButton *event, PidginWindow *win)
 		/* TODO:
 		 * If the line to scrollback to is greater /pidgin/gtk/conversations/scrollback_lines,
 		 * desensitise the widget so it at least displays.. or something like that. you get the drift. */
-			list = list->next;
 		}
 
 		pidgin_separator(menu);
@@ -319,13 +414,10 @@ displaying_msg_cb(PurpleAccount *account, const char *name, char **buffer,
 	PidginConversation *gtkconv;
 	GtkWidget *imhtml;
 	GtkTextIter iter;
-	GList *list;
-	int pos;
-	char *tmp, *who, *prefix = NULL;
+	NickSaidRing *ring;
 	NickSaid *said;
-	gboolean timestamp = purple_prefs_get_bool(PREF_TIMESTAMP);
-	gboolean datestamp = purple_prefs_get_bool(PREF_DATESTAMP);
-	gboolean showwho = purple_prefs_get_bool(PREF_SHOWWHO);
+	char *tmp;
+	guint limit = MAX(purple_prefs_get_int(PREF_LIMIT), 1);
 
 	if (!(flags & PURPLE_MESSAGE_NICK) || !PIDGIN_IS_PIDGIN_CONVERSATION(conv) ||
 			purple_conversation_get_type(conv) != PURPLE_CONV_TYPE_CHAT)
@@ -334,51 +426,31 @@ displaying_msg_cb(PurpleAccount *account, const char *name, char **buffer,
 	gtkconv = PIDGIN_CONVERSATION(conv);
 	imhtml = gtkconv->imhtml;
 
-	gtk_text_buffer_get_end_iter(GTK_IMHTML(imhtml)->text_buffer, &iter);
-	pos = gtk_text_iter_get_offset(&iter);
-	list = g_object_get_data(G_OBJECT(imhtml), "nicksaid:list");
-
-	tmp = purple_markup_strip_html(*buffer);
-	who = g_strndup(tmp, purple_prefs_get_int(PREF_CHARS));
-	g_free(tmp);
-
-	if (!g_utf8_validate(who, -1, (const char **)&tmp))
-		*tmp = '\0';
-
-	if (showwho) {
-		tmp = who;
-		who = g_strdup_printf("%s: %s", name, tmp);
-		g_free(tmp);
+	ring = g_object_get_data(G_OBJECT(imhtml), "nicksaid:list");
+	if (ring == NULL)
+	{
+		ring = g_new0(NickSaidRing, 1);
+		g_object_set_data_full(G_OBJECT(imhtml), "nicksaid:list", ring,
+				(GDestroyNotify)ns_ring_free);
 	}
+	if (ring->size != limit)
+		ns_ring_resize(ring, limit);
+	if (ring->count == ring->size)
+		ns_ring_drop_oldest(ring);
 
-	if (datestamp && timestamp) {
-		prefix = g_strdup_printf("(%s) ", ns_date_full());
-	} else if (datestamp && !timestamp) {
-		prefix = g_strdup_printf("(%s) ", ns_date());
-	} else if (!datestamp && timestamp) {
-		prefix = g_strdup_printf("(%s) ", ns_time());
-	}
+	said = ns_ring_nth(ring, ring->count++);
 
-	said = g_new0(NickSaid, 1);
-	said->offset = pos;
+	gtk_text_buffer_get_end_iter(GTK_IMHTML(imhtml)->text_buffer, &iter);
+	said->offset = gtk_text_iter_get_offset(&iter);
+	said->when = time(NULL);
+	ns_copy(said->name, name, NS_NAME_LEN);
 
-	if (prefix != NULL) {
-		said->who = g_strdup_printf("%s%s", prefix, who);
-		g_free(who);
-	} else {
-		said->who = who;
-	}
+	tmp = purple_markup_strip_html(*buffer);
+	ns_copy(said->text, tmp, NS_TEXT_LEN);
+	g_free(tmp);
 
 	if (purple_prefs_get_bool(PREF_SHOWALL))
-	{
-		said->what = g_strdup_printf("%s<b>%s: </b>%s",
-				prefix ? prefix : "", name, *buffer);
-	}
-
-	g_free(prefix);
-
-	list = g_list_prepend(list, said);
-	g_object_set_data(G_OBJECT(imhtml), "nicksaid:list", list);
+		said->what = g_strdup(*buffer);
 
 	return FALSE;
 }
@@ -602,6 +674,11 @@ get_plugin_pref_frame(PurplePlugin *plugin)
 					_("Allow displaying in a separate dialog"));
 	purple_plugin_pref_frame_add(frame, pref);
 
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_LIMIT,
+					_("_Maximum number of messages remembered\nin each chat"));
+	purple_plugin_pref_set_bounds(pref, 1, 1000);
+	purple_plugin_pref_frame_add(frame, pref);
+
 	return frame;
 }
 
@@ -667,6 +744,7 @@ init_plugin(PurplePlugin *plugin)
 	purple_prefs_add_bool(PREF_DATESTAMP, FALSE);
 	purple_prefs_add_bool(PREF_SHOWWHO, TRUE);
 	purple_prefs_add_bool(PREF_SHOWALL, FALSE);
+	purple_prefs_add_int(PREF_LIMIT, 50);
 }
 
 PURPLE_INIT_PLUGIN(PLUGIN_STATIC_NAME, init_plugin, info)
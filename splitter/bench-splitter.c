@@ -0,0 +1,212 @@
+/* Message Splitter Plugin benchmark
+ *
+ * Copyright (C) 2005-2007, Ike Gingerich <ike_@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* Feeds pastes of increasing size through the splitter's slicing
+ * (create_message_queue(): get_message_slices() and the markup slicer)
+ * with no display and no connection, and reports slices per second and
+ * the peak memory of the process.  For comparison, it also slices every
+ * paste up to 256 KiB with purple_markup_slice(), which is what the
+ * plugin used to do for each slice.
+ *
+ *     make bench-splitter
+ *     ./bench-splitter [-s split_size] [-m max_bytes] [paste.html ...]
+ *
+ * Each file is a pasted HTML corpus, cut into prefixes at line ends.
+ * With no files a synthetic corpus is generated.
+ */
+
+/* the static functions are what is being measured */
+#include "splitter.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+# include <sys/resource.h>
+#endif
+
+#define MIN_PASTE		1024
+#define OLD_WAY_LIMIT	(256 * 1024)
+
+/* peak resident size of the process so far, in KiB, or -1 */
+static long
+peak_memory(void) {
+#ifndef _WIN32
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		return usage.ru_maxrss;
+#endif
+	return -1;
+}
+
+static gchar *
+synthetic_paste(gsize size) {
+	static const char *pieces[] = {
+		"Some plain words of a pasted log, the way people paste them. ",
+		"<b>bold words</b> ",
+		"<i>italic <u>and underlined</u></i> ",
+		"<font color=\"#A82F2F\"><font size=\"2\">(12:34:56)</font> <b>nick:</b></font> ",
+		"<a href=\"http://example.com/?a=b&amp;c=d\">a link</a> ",
+		"&lt;tag&gt; &amp; &quot;entities&quot; ",
+		"<span style=\"font-family: monospace\">code();</span><br>\n",
+		"averyveryverylongwordwithoutanyplacetobreakitatallsoithastobecut ",
+	};
+	GString *str = g_string_sized_new(size + 128);
+	guint i = 0;
+
+	while (str->len < size)
+		g_string_append(str, pieces[i++ % G_N_ELEMENTS(pieces)]);
+
+	return g_string_free(str, FALSE);
+}
+
+/* the way the plugin sliced before: purple_markup_slice() from the start
+   of the message for every piece */
+static guint
+slice_old_way(const char *message) {
+	GQueue *slices;
+	message_slice *slice;
+	char *stripped, *msg;
+	guint n = 0;
+
+	stripped = purple_markup_strip_html(message);
+	slices = get_message_slices(stripped);
+
+	while ((slice = g_queue_pop_head(slices)) != NULL) {
+		msg = purple_markup_slice(message, slice->start, slice->end);
+		if (msg != NULL)
+			n++;
+		g_free(msg);
+		g_free(slice);
+	}
+
+	g_queue_free(slices);
+	g_free(stripped);
+
+	return n;
+}
+
+static void
+bench_paste(const char *paste) {
+	GTimer *timer = g_timer_new();
+	GQueue *messages;
+	gchar *msg;
+	gsize bytes = strlen(paste);
+	guint slices;
+	gdouble elapsed;
+
+	messages = create_message_queue(paste);
+	elapsed = g_timer_elapsed(timer, NULL);
+	slices = g_queue_get_length(messages);
+	while ((msg = g_queue_pop_head(messages)) != NULL)
+		g_free(msg);
+	g_queue_free(messages);
+
+	printf("%10lu %8u %10.2f %12.0f %8.2f %9ld",
+	       (unsigned long)bytes, slices, elapsed * 1000,
+	       slices / MAX(elapsed, 1e-9), bytes / MAX(elapsed, 1e-9) / (1024 * 1024),
+	       peak_memory());
+
+	if (bytes <= OLD_WAY_LIMIT) {
+		g_timer_start(timer);
+		slices = slice_old_way(paste);
+		elapsed = g_timer_elapsed(timer, NULL);
+		printf(" %10.2f %12.0f", elapsed * 1000, slices / MAX(elapsed, 1e-9));
+	}
+	printf("\n");
+
+	g_timer_destroy(timer);
+}
+
+static void
+print_header(const char *corpus) {
+	printf("\n%s, split size %d\n", corpus, current_split_size);
+	printf("%10s %8s %10s %12s %8s %9s %10s %12s\n", "bytes", "slices", "ms",
+	       "slices/s", "MB/s", "peak KiB", "old ms", "old slices/s");
+}
+
+/* prefixes of the paste, doubling in size and cut at line ends */
+static void
+bench_corpus(const char *name, const char *text, gsize max) {
+	gsize step, size, last = 0, len = MIN(strlen(text), max);
+	const char *cut;
+	gchar *prefix;
+
+	print_header(name);
+
+	for (step = MIN_PASTE; ; step *= 2) {
+		size = MIN(step, len);
+		if (size < len && (cut = g_strrstr_len(text, size, "\n")) != NULL && cut > text)
+			size = cut - text;
+
+		if (size > last) {
+			prefix = g_strndup(text, size);
+			bench_paste(prefix);
+			g_free(prefix);
+			last = size;
+		}
+
+		if (step >= len)
+			break;
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	gsize max = 4 * 1024 * 1024;
+	gchar *text;
+	int i;
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+	g_type_init();
+#endif
+
+	current_split_size = DEFAULT_SPLIT_SIZE;
+
+	for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (!strcmp(argv[i], "-s"))
+			current_split_size = CLAMP(atoi(argv[i + 1]), MIN_SPLIT_SIZE, MAX_SPLIT_SIZE);
+		else if (!strcmp(argv[i], "-m"))
+			max = MAX(atol(argv[i + 1]), MIN_PASTE);
+		else
+			break;
+	}
+
+	if (i == argc) {
+		text = synthetic_paste(max);
+		bench_corpus("synthetic", text, max);
+		g_free(text);
+	}
+
+	for (; i < argc; i++) {
+		if (!g_file_get_contents(argv[i], &text, NULL, NULL)) {
+			fprintf(stderr, "can't read %s\n", argv[i]);
+			return 1;
+		}
+		bench_corpus(argv[i], text, max);
+		g_free(text);
+	}
+
+	if (splitter_context != NULL)
+		g_object_unref(splitter_context);
+
+	return 0;
+}
@@ -35,6 +35,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <debug.h>
 #include <notify.h>
@@ -57,6 +58,12 @@ static const gint MIN_DELAY_MS       =       0;
 static const gint DEFAULT_DELAY_MS   =     500;
 static const gint MAX_DELAY_MS       = 3600000; 
 
+static const gint MIN_BURST          =       1;
+static const gint DEFAULT_BURST      =       1;
+static const gint MAX_BURST          =     100;
+
+#define PREFS_PROTOCOLS "/plugins/core/splitter/protocols"
+
 typedef struct
 {
 	char *sender_username;
@@ -75,6 +82,24 @@ typedef struct {
 	gint end;
 } message_slice;
 
+/* Everything waiting to go out on one account, paste after paste. Sending
+   is paced by a token bucket: a message costs a token, there are at most
+   'burst' of them, and one comes back every 'delay_ms'. */
+typedef struct
+{
+	GQueue *pending;	/* message_to_conv, oldest first */
+	gint burst;
+	gint delay_ms;
+	gdouble tokens;
+	GTimeVal refilled;	/* when tokens was last brought up to date */
+} send_queue;
+
+/* "protocol_id username" -> send_queue */
+static GHashTable *send_queues = NULL;
+
+/* the one timer that drains all of them */
+static guint send_timer = 0;
+
 /* Global variable to block infinite loops. Single-threaded is nice */
 static gboolean splitter_injected_message = FALSE;
 
@@ -86,6 +111,7 @@ static PurplePluginPrefFrame *
 get_plugin_pref_frame(PurplePlugin *plugin) {
 	PurplePluginPrefFrame *frame;
 	PurplePluginPref      *ppref;
+	GList *protocols, *l;
 
 	frame = purple_plugin_pref_frame_new();
 	g_return_val_if_fail(frame != NULL, NULL);
@@ -107,6 +133,37 @@ get_plugin_pref_frame(PurplePlugin *plugin) {
 	g_return_val_if_fail(ppref != NULL, NULL);
 	purple_plugin_pref_set_bounds(ppref, MIN_DELAY_MS, MAX_DELAY_MS);
 	purple_plugin_pref_frame_add(frame, ppref);
+	ppref = purple_plugin_pref_new_with_name_and_label("/plugins/core/splitter/burst", 
+							 "Messages sent before the delay applies: ");
+	g_return_val_if_fail(ppref != NULL, NULL);
+	purple_plugin_pref_set_bounds(ppref, MIN_BURST, MAX_BURST);
+	purple_plugin_pref_frame_add(frame, ppref);
+
+	/* protocols with limits of their own */
+	protocols = purple_prefs_get_children_names(PREFS_PROTOCOLS);
+	for (l = protocols; l != NULL; l = l->next) {
+		gchar *path = l->data;
+		gchar *pref;
+
+		ppref = purple_plugin_pref_new_with_label(strrchr(path, '/') + 1);
+		purple_plugin_pref_frame_add(frame, ppref);
+
+		pref = g_strconcat(path, "/delay_ms", NULL);
+		ppref = purple_plugin_pref_new_with_name_and_label(pref, "Delay (ms): ");
+		purple_plugin_pref_set_bounds(ppref, MIN_DELAY_MS, MAX_DELAY_MS);
+		purple_plugin_pref_frame_add(frame, ppref);
+		g_free(pref);
+
+		pref = g_strconcat(path, "/burst", NULL);
+		ppref = purple_plugin_pref_new_with_name_and_label(pref,
+							 "Messages sent before the delay applies: ");
+		purple_plugin_pref_set_bounds(ppref, MIN_BURST, MAX_BURST);
+		purple_plugin_pref_frame_add(frame, ppref);
+		g_free(pref);
+
+		g_free(path);
+	}
+	g_list_free(protocols);
 
 	return frame;
 }
@@ -168,9 +225,26 @@ splitter_common_send(PurpleConversation *conv, const char *message,
 	g_free(sent);
 }
 
-/* a timer based callback function that sends the next message in the queue */
+static void
+message_to_conv_free(message_to_conv *msg_to_conv) {
+	gchar *msg;
+
+	while ((msg = g_queue_pop_head(msg_to_conv->messages)) != NULL)
+		g_free(msg);
+	g_queue_free(msg_to_conv->messages);
+	g_free(msg_to_conv->sender_username);
+	g_free(msg_to_conv->sender_protocol_id);
+	if( msg_to_conv->type == PURPLE_CONV_TYPE_IM &&
+		msg_to_conv->receiver != NULL )
+	g_free(msg_to_conv->receiver);
+
+	g_free(msg_to_conv);
+}
+
+/* sends the next message of a paste; returns FALSE if there was none
+   or it can't be sent any more */
 static gboolean
-send_message_timer_cb( message_to_conv *msg_to_conv ) {
+send_next_message( message_to_conv *msg_to_conv ) {
 	PurpleAccount *account;
 	PurpleConversation *conv;
 	gchar *msg;
@@ -180,45 +254,234 @@ send_message_timer_cb( message_to_conv *msg_to_conv ) {
 	g_return_val_if_fail(msg_to_conv->sender_username    != NULL, FALSE);
 	g_return_val_if_fail(msg_to_conv->sender_protocol_id != NULL, FALSE);
 
+	if (g_queue_is_empty(msg_to_conv->messages))
+		return FALSE;
+
+	/* find account info (it may have changed) and try and create a new
+	   conversation window (it may have been closed) or find the existing
+	   chat, and finally send the message */
+	account = purple_accounts_find(msg_to_conv->sender_username,
+				     msg_to_conv->sender_protocol_id);
+	g_return_val_if_fail(account != NULL, FALSE);
+
+	if( msg_to_conv->type == PURPLE_CONV_TYPE_IM && msg_to_conv->receiver != NULL )
+		conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, account, msg_to_conv->receiver);
+	else if( msg_to_conv->type == PURPLE_CONV_TYPE_CHAT )
+		conv = purple_find_chat(account->gc, msg_to_conv->id);
+	else
+		conv = NULL;
+
+	g_return_val_if_fail(conv != NULL, FALSE);
+
 	msg = g_queue_pop_head(msg_to_conv->messages);
+	splitter_common_send(conv, msg, PURPLE_MESSAGE_SEND);
+	g_free(msg);
 
-	if( msg == NULL )
-	{
-		/* clean up and terminate timer callback */
-		g_queue_free(msg_to_conv->messages);
-		g_free(msg_to_conv->sender_username);
-		g_free(msg_to_conv->sender_protocol_id);
-		if( msg_to_conv->type == PURPLE_CONV_TYPE_IM &&
-			msg_to_conv->receiver != NULL )
-		g_free(msg_to_conv->receiver);
+	return TRUE;
+}
 
-		g_free(msg_to_conv);
+static void
+send_queue_free(send_queue *queue) {
+	message_to_conv *msg_to_conv;
 
-		return FALSE;
+	while ((msg_to_conv = g_queue_pop_head(queue->pending)) != NULL)
+		message_to_conv_free(msg_to_conv);
+	g_queue_free(queue->pending);
+	g_free(queue);
+}
+
+/* the protocol's own limits if it has any, the general ones otherwise */
+static void
+read_send_limits(send_queue *queue, const char *protocol_id) {
+	gchar *burst, *delay;
+
+	burst = g_strdup_printf(PREFS_PROTOCOLS "/%s/burst", protocol_id);
+	delay = g_strdup_printf(PREFS_PROTOCOLS "/%s/delay_ms", protocol_id);
+
+	queue->burst = purple_prefs_exists(burst) ? purple_prefs_get_int(burst)
+	             : purple_prefs_get_int("/plugins/core/splitter/burst");
+	queue->delay_ms = purple_prefs_exists(delay) ? purple_prefs_get_int(delay)
+	                : purple_prefs_get_int("/plugins/core/splitter/delay_ms");
+
+	queue->burst = CLAMP(queue->burst, MIN_BURST, MAX_BURST);
+	queue->delay_ms = CLAMP(queue->delay_ms, MIN_DELAY_MS, MAX_DELAY_MS);
+
+	g_free(burst);
+	g_free(delay);
+}
+
+/* wait until the first account has a token again, in ms; -1 for never */
+static gint next_send_wait;
+
+static gboolean send_queues_cb(gpointer data);
+
+static void
+schedule_send_queues(gint wait) {
+	if (send_timer != 0)
+		return;
+	send_timer = purple_timeout_add(wait, send_queues_cb, NULL);
+}
+
+/* send what the bucket allows; returns TRUE when the queue can go */
+static gboolean
+drain_send_queue(gpointer key, send_queue *queue, GTimeVal *now) {
+	message_to_conv *msg_to_conv;
+	gdouble elapsed;
+	gint wait;
+
+	if (queue->delay_ms == 0)
+		queue->tokens = queue->burst;
+	else {
+		elapsed = (now->tv_sec - queue->refilled.tv_sec) * 1000.0 +
+		          (now->tv_usec - queue->refilled.tv_usec) / 1000.0;
+		queue->tokens = MIN(queue->burst, queue->tokens + elapsed / queue->delay_ms);
+	}
+	queue->refilled = *now;
+
+	while (queue->tokens >= 1 && (msg_to_conv = g_queue_peek_head(queue->pending)) != NULL) {
+		if (!send_next_message(msg_to_conv)) {
+			/* nowhere to send the rest */
+			g_queue_pop_head(queue->pending);
+			message_to_conv_free(msg_to_conv);
+			continue;
+		}
+		queue->tokens -= 1;
+
+		if (g_queue_is_empty(msg_to_conv->messages)) {
+			g_queue_pop_head(queue->pending);
+			message_to_conv_free(msg_to_conv);
+		}
 	}
-	else
-	{
-		/* find account info (it may have changed) and try and create a new
-		   conversation window (it may have been closed) or find the existing
-		   chat, and finally send the message */
-		account = purple_accounts_find(msg_to_conv->sender_username,
-					     msg_to_conv->sender_protocol_id);
-		g_return_val_if_fail(account != NULL, FALSE);
-
-		if( msg_to_conv->type == PURPLE_CONV_TYPE_IM && msg_to_conv->receiver != NULL )
-			conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, account, msg_to_conv->receiver);
-		else if( msg_to_conv->type == PURPLE_CONV_TYPE_CHAT )
-			conv = purple_find_chat(account->gc, msg_to_conv->id);
-		else
-			conv = NULL;
-
-		g_return_val_if_fail(conv != NULL, FALSE);
-
-		splitter_common_send(conv, msg, PURPLE_MESSAGE_SEND);
-		g_free(msg);
 
+	/* forget the account only once the bucket is full again, or the
+	   next paste would get a fresh burst */
+	if (g_queue_is_empty(queue->pending) && queue->tokens >= queue->burst)
 		return TRUE;
+
+	if (!g_queue_is_empty(queue->pending))
+		wait = (1 - queue->tokens) * queue->delay_ms + 1;
+	else
+		wait = (queue->burst - queue->tokens) * queue->delay_ms + 1;
+	if (next_send_wait < 0 || wait < next_send_wait)
+		next_send_wait = wait;
+
+	return FALSE;
+}
+
+static void
+collect_send_queue(gpointer key, gpointer value, GList **keys) {
+	*keys = g_list_prepend(*keys, g_strdup(key));
+}
+
+/* the single timer behind all sending */
+static gboolean
+send_queues_cb(gpointer data) {
+	GTimeVal now;
+	GList *keys = NULL, *l;
+	send_queue *queue;
+
+	send_timer = 0;
+	next_send_wait = -1;
+
+	/* sending can get back into queue_message() (another plugin may send
+	   when a conversation is created), so don't send while walking the
+	   table */
+	g_hash_table_foreach(send_queues, (GHFunc)collect_send_queue, &keys);
+
+	g_get_current_time(&now);
+	for (l = keys; l != NULL; l = l->next) {
+		queue = g_hash_table_lookup(send_queues, l->data);
+		if (queue != NULL && drain_send_queue(l->data, queue, &now))
+			g_hash_table_remove(send_queues, l->data);
+		g_free(l->data);
 	}
+	g_list_free(keys);
+
+	if (next_send_wait >= 0)
+		schedule_send_queues(next_send_wait);
+
+	return FALSE;
+}
+
+/* messages still to go out on an account */
+static guint
+send_queue_depth(send_queue *queue) {
+	GList *l;
+	guint depth = 0;
+
+	for (l = queue->pending->head; l != NULL; l = l->next)
+		depth += g_queue_get_length(((message_to_conv *)l->data)->messages);
+
+	return depth;
+}
+
+/* tells the conversation a paste has to wait for the ones before it */
+static void
+show_send_queue(message_to_conv *msg_to_conv, send_queue *queue) {
+	PurpleAccount *account;
+	PurpleConversation *conv = NULL;
+	guint depth = send_queue_depth(queue);
+	gchar *text;
+
+	if (queue->delay_ms == 0 || depth <= (guint)queue->tokens)
+		return;
+
+	account = purple_accounts_find(msg_to_conv->sender_username,
+	                               msg_to_conv->sender_protocol_id);
+	if (account == NULL)
+		return;
+
+	if (msg_to_conv->type == PURPLE_CONV_TYPE_IM)
+		conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM,
+		                                             msg_to_conv->receiver, account);
+	else if (account->gc != NULL)
+		conv = purple_find_chat(account->gc, msg_to_conv->id);
+	if (conv == NULL)
+		return;
+
+	text = g_strdup_printf(_("%u messages waiting to be sent on this account, "
+	                         "about %u seconds to go."), depth,
+	                       (guint)((depth - (guint)queue->tokens) *
+	                               (gdouble)queue->delay_ms / 1000 + 0.5));
+	purple_conversation_write(conv, NULL, text,
+	                          PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
+	g_free(text);
+}
+
+/* put a split message at the back of its account's queue */
+static void
+queue_message(message_to_conv *msg_to_conv) {
+	send_queue *queue;
+	gchar *key;
+
+	if (send_queues == NULL)
+		send_queues = g_hash_table_new_full(g_str_hash, g_str_equal,
+		                                    g_free, (GDestroyNotify)send_queue_free);
+
+	key = g_strdup_printf("%s %s", msg_to_conv->sender_protocol_id,
+	                      msg_to_conv->sender_username);
+	queue = g_hash_table_lookup(send_queues, key);
+	if (queue == NULL) {
+		queue = g_new0(send_queue, 1);
+		queue->pending = g_queue_new();
+		read_send_limits(queue, msg_to_conv->sender_protocol_id);
+		queue->tokens = queue->burst;
+		g_get_current_time(&queue->refilled);
+		g_hash_table_insert(send_queues, key, queue);
+	} else {
+		read_send_limits(queue, msg_to_conv->sender_protocol_id);
+		g_free(key);
+	}
+
+	g_queue_push_tail(queue->pending, msg_to_conv);
+	show_send_queue(msg_to_conv, queue);
+
+	/* not from inside the sending signal */
+	if (send_timer != 0) {
+		purple_timeout_remove(send_timer);
+		send_timer = 0;
+	}
+	schedule_send_queues(0);
 }
 
 /* Create/get a pango context
@@ -235,84 +498,81 @@ splitter_create_pango_context(void) {
 #endif
 }
 
-/* finds the first line-breakable character backwards starting from a[last]  */
-static gint
-find_last_break(PangoLogAttr *a, int last) {
-	for(; last > 0; last-- )
-		if( a[last].is_line_break == 1)
-			break;
-
-	return ( a[last].is_line_break == 1) ? last-1 : -1;
-}
+/* one context for the whole session, released in plugin_unload() */
+static PangoContext *splitter_context = NULL;
 
 /* uses Pango to find all possible line break locations in a message and returns
-   a PangoLogAttr array which maps to each byte of the message of length
-   one larger than the message.  This must be g_free()'d */
+   a PangoLogAttr array with one entry per character of the message, plus one
+   for the end.  The number of characters is put in n_chars.  This must be
+   g_free()'d */
 static PangoLogAttr *
-find_all_breaks(const char *message) {
-	PangoContext *context;
+find_all_breaks(const char *message, gint *n_chars) {
 	PangoLogAttr *a;
-	GList *list;
-	gint len, n_attr;
 
 	g_return_val_if_fail(message != NULL, NULL);
 
-	len  = strlen(message);
-	n_attr = len+1;
-	a = g_new0(PangoLogAttr, n_attr);
-
-	/* init Pango */
-	context = splitter_create_pango_context();
-
-	g_return_val_if_fail(context != NULL, NULL);
+	if (splitter_context == NULL)
+		splitter_context = splitter_create_pango_context();
+	g_return_val_if_fail(splitter_context != NULL, NULL);
 
-	list = pango_itemize(context, message, 0, len, NULL, NULL);
+	*n_chars = g_utf8_strlen(message, -1);
+	a = g_new0(PangoLogAttr, *n_chars + 1);
 
-	if (list != NULL && list->data != NULL)
-		pango_break(message, -1, &((PangoItem*)(list->data))->analysis, a, n_attr);
+	/* one pass over the text, without itemizing it first */
+	pango_get_log_attrs(message, strlen(message), -1,
+	                    pango_context_get_language(splitter_context),
+	                    a, *n_chars + 1);
 
 	return a;
 }
 
 /* return a queue of message slices from a plain text message based on current_split_size using
-   Pango to determine possible line break locations */
+   Pango to determine possible line break locations.  Slices are in characters, which is
+   what purple_markup_slice() wants */
 static GQueue *
 get_message_slices(const char *message) {
-	gint current_break_start, last_break_start, break_pos, len;
+	gint start, end, next, last_break, i, len;
 	message_slice *slice;
 	PangoLogAttr *a;
 	GQueue *q;
 
-	q = g_queue_new();
-	len = strlen(message);
-	a = find_all_breaks(message);
+	a = find_all_breaks(message, &len);
 	g_return_val_if_fail(a != NULL, NULL);
+	q = g_queue_new();
 
-	last_break_start = current_break_start = 0;
+	/* a single walk forward: i never goes back, and last_break is the
+	   latest place a line may break before it */
+	start = 0;
+	last_break = -1;
+	i = 1;
 
-	while(current_break_start + current_split_size < len)
+	while(start + current_split_size < len)
 	{
-		break_pos = find_last_break(a + last_break_start, current_split_size);
-
-		if( break_pos > -1 )   current_break_start += break_pos;
-		else                   current_break_start += current_split_size;
-
-		slice = g_new0( message_slice, 1 );
-		slice->start = MAX( last_break_start, 0 );
-		slice->end   = MIN( current_break_start, len );
-
-		if( slice->end > slice->start )
+		for(; i <= start + current_split_size; i++)
+			if( a[i].is_line_break )
+				last_break = i;
+
+		if( last_break > start ) {
+			/* leave out the whitespace in front of the break */
+			end  = last_break - 1;
+			next = last_break;
+		} else {
+			end  = start + current_split_size;
+			next = end;
+		}
+
+		if( end > start ) {
+			slice = g_new0( message_slice, 1 );
+			slice->start = start;
+			slice->end   = end;
 			g_queue_push_tail(q, slice);
-		else	g_free(slice);
-
-		if( break_pos > -1 )
-			current_break_start++;
+		}
 
-		last_break_start = current_break_start;
+		start = next;
 	}
 
 	slice = g_new0( message_slice, 1 );
-	slice->start = last_break_start;
+	slice->start = start;
 	slice->end   = len;
 	g_queue_push_tail(q, slice);
 
@@ -323,6 +583,135 @@ get_message_slices(const char *message) {
 	
 }
 
+/* Cuts markup into pieces the way purple_markup_slice() does, but for a
+   series of increasing, non-overlapping ranges.  purple_markup_slice()
+   walks the message from the start for every piece, which makes splitting
+   a long paste quadratic; this carries on from where the last piece
+   ended.  The text before a piece only matters for which tags are open,
+   so the result is the same. */
+typedef struct {
+	const char *str;	/* how far we have got */
+	guint z;		/* characters of text before str */
+	GQueue *tags;		/* tags open at str, innermost first */
+	const char *jump;	/* an <img>, <br> or <hr> the last piece ended on */
+	gboolean failed;	/* ran into a '<' or '&' that isn't closed */
+} markup_slicer;
+
+static void
+markup_slicer_init(markup_slicer *slicer, const char *str) {
+	slicer->str = str;
+	slicer->z = 0;
+	slicer->tags = g_queue_new();
+	slicer->jump = NULL;
+	slicer->failed = FALSE;
+}
+
+static void
+markup_slicer_destroy(markup_slicer *slicer) {
+	char *tag;
+
+	while ((tag = g_queue_pop_head(slicer->tags)) != NULL)
+		g_free(tag);
+	g_queue_free(slicer->tags);
+}
+
+/* the markup for characters x to y, which must not start before the
+   end of the previous piece */
+static char *
+markup_slicer_next(markup_slicer *slicer, guint x, guint y) {
+	const char *str = slicer->str;
+	gboolean appended = FALSE;
+	GString *ret;
+	GList *l;
+	gunichar c;
+	char *tag, *end;
+
+	if (x == y)
+		return g_strdup("");
+	if (slicer->failed)
+		return NULL;
+
+	ret = g_string_new("");
+
+	/* these count as several characters, so purple_markup_slice() puts
+	   one into every piece it overlaps */
+	if (slicer->jump != NULL && slicer->z >= x)
+		g_string_append_len(ret, slicer->jump, strchr(slicer->jump, '>') - slicer->jump + 1);
+
+	while (*str && slicer->z < y) {
+		c = g_utf8_get_char(str);
+		slicer->jump = NULL;
+
+		if (c == '<') {
+			end = strchr(str, '>');
+			if (end == NULL) {
+				slicer->failed = TRUE;
+				g_string_free(ret, TRUE);
+				return NULL;
+			}
+
+			if (!g_ascii_strncasecmp(str, "<img ", 5)) {
+				slicer->z += strlen("[Image]");
+				slicer->jump = str;
+			} else if (!g_ascii_strncasecmp(str, "<br", 3)) {
+				slicer->z += 1;
+				slicer->jump = str;
+			} else if (!g_ascii_strncasecmp(str, "<hr>", 4)) {
+				slicer->z += strlen("\n---\n");
+				slicer->jump = str;
+			} else if (!g_ascii_strncasecmp(str, "</", 2))
+				g_free(g_queue_pop_head(slicer->tags));
+			else
+				g_queue_push_head(slicer->tags, g_strndup(str, end - str + 1));
+
+			if (slicer->z >= x)
+				g_string_append_len(ret, str, end - str + 1);
+
+			str = end;
+		} else if (c == '&') {
+			end = strchr(str, ';');
+			if (end == NULL) {
+				slicer->failed = TRUE;
+				g_string_free(ret, TRUE);
+				return NULL;
+			}
+
+			if (slicer->z >= x)
+				g_string_append_len(ret, str, end - str + 1);
+
+			slicer->z++;
+			str = end;
+		} else {
+			if (slicer->z == x && slicer->z > 0 && !appended) {
+				/* reopen whatever was open where the piece starts */
+				for (l = slicer->tags->tail; l != NULL; l = l->prev)
+					g_string_append(ret, l->data);
+				appended = TRUE;
+			}
+
+			if (slicer->z >= x)
+				g_string_append_unichar(ret, c);
+			slicer->z++;
+		}
+
+		str = g_utf8_next_char(str);
+	}
+	slicer->str = str;
+
+	/* and close them again; they stay open for the next piece */
+	for (l = slicer->tags->head; l != NULL; l = l->next) {
+		int i;
+
+		/* the name ends where purple_markup_get_tag_name() ends it */
+		tag = l->data;
+		for (i = 1; tag[i] && tag[i] != ' ' && tag[i] != '>' && tag[i] != '/'; i++)
+			;
+		g_string_append_printf(ret, "</%.*s>", i - 1, tag + 1);
+	}
+
+	return g_string_free(ret, FALSE);
+}
+
 /* takes a message, splits it up based on whitespace (ignoring HTML formatting),
    requests HTMLized slices of the splits, and returns a queue of them.  The
    messages and the queue must be freed */
@@ -330,6 +719,7 @@ static GQueue *
 create_message_queue(const char *message) {
 	GQueue *slices, *messages;
 	message_slice *slice;
+	markup_slicer slicer;
 	char *stripped_message, *msg;
 
 	stripped_message = purple_markup_strip_html(message);
@@ -338,15 +728,17 @@ create_message_queue(const char *message) {
 	slices   = get_message_slices(stripped_message);
 	g_return_val_if_fail(slices != NULL, NULL);
 
+	markup_slicer_init(&slicer, message);
 	while( (slice = g_queue_pop_head(slices)) != NULL )
 	{
-		msg = purple_markup_slice(message, slice->start, slice->end);
+		msg = markup_slicer_next(&slicer, slice->start, slice->end);
 
 		if( msg != NULL )
 			g_queue_push_tail(messages, msg);
 
 		g_free(slice);
 	}
+	markup_slicer_destroy(&slicer);
 
 	g_queue_free(slices);
 
@@ -356,11 +748,9 @@ create_message_queue(const char *message) {
 	return messages;
 }
 
-/* create message queue and prepare timer callbacks */
+/* create message queue and hand it to the account's send queue */
 static void
 split_and_send(message_to_conv *msg_to_conv, const char **message) {
-	gint message_delay_ms;
-
 	g_return_if_fail( msg_to_conv != NULL );
 	g_return_if_fail( message     != NULL );
 	g_return_if_fail( *message    != NULL );
@@ -370,18 +760,11 @@ split_and_send(message_to_conv *msg_to_conv, const char **message) {
 	if( current_split_size > MAX_SPLIT_SIZE ) current_split_size = MAX_SPLIT_SIZE;
 	if( current_split_size < MIN_SPLIT_SIZE ) current_split_size = MIN_SPLIT_SIZE;
 
-	message_delay_ms = purple_prefs_get_int("/plugins/core/splitter/delay_ms");
-	if( message_delay_ms > MAX_DELAY_MS ) message_delay_ms = MAX_DELAY_MS;
-	if( message_delay_ms < MIN_DELAY_MS ) message_delay_ms = MIN_DELAY_MS;
-
 	/* prepare message queue */
 	msg_to_conv->messages = create_message_queue(*message);
 	g_return_if_fail( msg_to_conv->messages != NULL );
 
-	/* initialize message send timer */
-	purple_timeout_add( (g_queue_get_length(msg_to_conv->messages) > 1) ? message_delay_ms : 0,
-			  (GSourceFunc)send_message_timer_cb,
-			  msg_to_conv);
+	queue_message(msg_to_conv);
 
 	/* free the original message and ensure it does not get sent */
 	g_free((char*)*message);
@@ -465,9 +848,55 @@ plugin_load(PurplePlugin *plugin) {
 
 static gboolean
 plugin_unload(PurplePlugin *plugin) {
+	/* whatever hasn't been sent yet is dropped */
+	if (send_timer != 0) {
+		purple_timeout_remove(send_timer);
+		send_timer = 0;
+	}
+	if (send_queues != NULL) {
+		g_hash_table_destroy(send_queues);
+		send_queues = NULL;
+	}
+
+	if (splitter_context != NULL) {
+		g_object_unref(splitter_context);
+		splitter_context = NULL;
+	}
+
 	return TRUE;
 }
 
+static void
+list_send_queue(gchar *key, send_queue *queue, GString *str) {
+	/* key is "protocol_id username" */
+	gchar *username = g_markup_escape_text(strchr(key, ' ') + 1, -1);
+
+	g_string_append_printf(str, _("<b>%s:</b> %u message(s)<br>"),
+	                       username, send_queue_depth(queue));
+	g_free(username);
+}
+
+static void
+show_send_queues_cb(PurplePluginAction *action) {
+	GString *str = g_string_new(NULL);
+
+	if (send_queues != NULL)
+		g_hash_table_foreach(send_queues, (GHFunc)list_send_queue, str);
+	if (str->len == 0)
+		g_string_append(str, _("Nothing is waiting to be sent."));
+
+	purple_notify_formatted(action->plugin, _("Message Splitter"),
+	                        _("Messages waiting to be sent"), NULL, str->str,
+	                        NULL, NULL);
+	g_string_free(str, TRUE);
+}
+
+static GList *
+actions(PurplePlugin *plugin, gpointer context) {
+	return g_list_append(NULL, purple_plugin_action_new(_("Show Send Queues"),
+	                                                    show_send_queues_cb));
+}
+
 static PurplePluginUiInfo prefs_info = {
 	get_plugin_pref_frame, 0, NULL, NULL, NULL, NULL, NULL
 };
@@ -498,7 +927,7 @@ static PurplePluginInfo info = {
 	NULL,
 	NULL,
 	&prefs_info,
-	NULL,
+	actions,
 	NULL,
 	NULL,
 	NULL,
@@ -521,6 +950,14 @@ init_plugin(PurplePlugin *plugin) {
 	purple_prefs_add_none("/plugins/core/splitter");
 	purple_prefs_add_int ("/plugins/core/splitter/split_size", DEFAULT_SPLIT_SIZE);
 	purple_prefs_add_int ("/plugins/core/splitter/delay_ms",   DEFAULT_DELAY_MS);
+	purple_prefs_add_int ("/plugins/core/splitter/burst",      DEFAULT_BURST);
+
+	/* IRC servers kick for flooding: about one line every two seconds,
+	   after a short burst, is what most of them put up with */
+	purple_prefs_add_none(PREFS_PROTOCOLS);
+	purple_prefs_add_none(PREFS_PROTOCOLS "/prpl-irc");
+	purple_prefs_add_int (PREFS_PROTOCOLS "/prpl-irc/delay_ms", 2000);
+	purple_prefs_add_int (PREFS_PROTOCOLS "/prpl-irc/burst",    4);
 }
 
 PURPLE_INIT_PLUGIN(splitter, init_plugin, info)
@@ -0,0 +1,1044 @@
+/*
+ * TimeLog plugin.
+ *
+ * Copyright (C) 2006 Jon Oberheide.
+ * Copyright (C) 2007-2008 Stu Tomlinson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * An index of every log, sorted by the time it was started, so a time
+ * range can be looked up without listing the whole log tree.  It lives in
+ * timelog.idx in the user's directory, as a header line
+ *
+ *     "timelog-index 4 " next id <space> stamp
+ *
+ * and then one log per line:
+ *
+ *     id <tab> words <tab> read <tab> start <tab> end <tab> type <tab>
+ *     protocol <tab> username <tab> name <tab> path
+ *
+ * with the strings escaped by g_strescape().  It is built by scanning every
+ * log set the first time it is needed, and after that kept up to date as
+ * conversations write to their logs.
+ *
+ * Logs can be written or deleted while the plugin isn't loaded, so on load
+ * every log set whose directory changed after the index was saved is
+ * listed again, from an idle callback, one set at a time.
+ *
+ * Each log also gets an id for the text index (see text-index.c).  Logs
+ * that were written before the text index knew about them are read and
+ * indexed from an idle callback, one at a time.  The text index is big, so
+ * it is only loaded for the first search; until then nothing is added to
+ * it, and the index is saved with the stamp of the one on disk.
+ */
+
+/* If you can't figure out what this line is for, DON'T TOUCH IT. */
+#include "../common/pp_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include <account.h>
+#include <conversation.h>
+#include <debug.h>
+#include <log.h>
+#include <plugin.h>
+#include <signals.h>
+#include <util.h>
+
+#include "timelog.h"
+#include "log-index.h"
+#include "text-index.h"
+
+#include <sys/stat.h>
+#if GLIB_CHECK_VERSION(2,6,0)
+#include <glib/gstdio.h>
+#else
+#define g_fopen fopen
+#define g_stat stat
+#endif
+
+#define INDEX_FILE		"timelog.idx"
+#define INDEX_VERSION	"timelog-index 4"
+
+/* how long to wait after a change before writing the index out; the text
+   index is written out with it, and that can be big */
+#define SAVE_DELAY		60000
+
+/* the most a log's file time is believed to be after the log started; a
+   file that was copied without its times has the time of the copy */
+#define MAX_LOG_SPAN	(24 * 60 * 60)
+
+typedef struct {
+	guint id;
+	int words;			/* words in the text index so far, or -1 if none */
+	long read;			/* bytes of the file that are in the text index */
+	time_t start;
+	time_t end;			/* the last time the log was written to */
+	PurpleLogType type;
+	char *protocol;
+	char *username;
+	char *name;
+	char *path;			/* the log's file, or "" if the logger has none */
+} log_index_entry_t;
+
+static GPtrArray *entries = NULL;		/* sorted by start */
+static GHashTable *entry_table = NULL;	/* entry_key() -> entry */
+static gboolean built = FALSE;
+static gboolean text_loaded = FALSE;	/* the text index is in memory */
+static char *text_stamp = NULL;			/* of the one on disk, until then */
+static guint save_timer = 0;
+static guint next_id = 0;
+static time_t load_time;
+static time_t save_time;				/* when the index on disk was saved */
+static time_t longest = 0;				/* the longest log, end - start */
+
+/* the loggers that keep a log in a file of its own, once one of their logs
+   has been seen, so their logs can be made up from the index */
+static PurpleLogLogger *html_logger = NULL;
+static PurpleLogLogger *txt_logger = NULL;
+
+static GHashTable *log_sets = NULL;		/* being checked against the disk */
+static GList *unchecked = NULL;			/* the sets in it not checked yet */
+static guint check_idle = 0;
+
+static GQueue *unindexed = NULL;		/* entries to read into the text index */
+static guint index_idle = 0;
+
+static char *
+entry_key(const char *protocol, const char *username, PurpleLogType type,
+		const char *name, time_t start)
+{
+	return g_strdup_printf("%s\t%s\t%d\t%s\t%lu", protocol, username, type, name,
+			(unsigned long)start);
+}
+
+static void
+entry_free(log_index_entry_t *entry)
+{
+	g_free(entry->protocol);
+	g_free(entry->username);
+	g_free(entry->name);
+	g_free(entry->path);
+	g_free(entry);
+}
+
+/* the position of the first entry that started at or after t */
+static guint
+lower_bound(time_t t)
+{
+	guint lo = 0, hi = entries->len, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (((log_index_entry_t *)g_ptr_array_index(entries, mid))->start < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void
+clear_entries(void)
+{
+	while (g_queue_pop_head(unindexed))
+		;
+	g_hash_table_destroy(entry_table);
+	entry_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_ptr_array_foreach(entries, (GFunc)entry_free, NULL);
+	g_ptr_array_set_size(entries, 0);
+	longest = 0;
+}
+
+/* Adds a log to the index, or moves its end time forward if it is there. */
+static log_index_entry_t *
+add_entry(guint id, int words, PurpleLogType type, const char *protocol,
+		const char *username, const char *name, time_t start, time_t end,
+		const char *path)
+{
+	log_index_entry_t *entry;
+	char *key;
+	guint i;
+
+	key = entry_key(protocol, username, type, name, start);
+	entry = g_hash_table_lookup(entry_table, key);
+	if (entry != NULL) {
+		g_free(key);
+		if (end > entry->end) {
+			entry->end = end;
+			longest = MAX(longest, end - start);
+		}
+		if (!*entry->path && path && *path) {
+			g_free(entry->path);
+			entry->path = g_strdup(path);
+		}
+		return entry;
+	}
+
+	entry = g_new0(log_index_entry_t, 1);
+	entry->id = id;
+	entry->words = words;
+	entry->start = start;
+	entry->end = MAX(start, end);
+	longest = MAX(longest, entry->end - start);
+	entry->type = type;
+	entry->protocol = g_strdup(protocol);
+	entry->username = g_strdup(username);
+	entry->name = g_strdup(name);
+	entry->path = g_strdup(path ? path : "");
+	g_hash_table_insert(entry_table, key, entry);
+
+	/* new logs are almost always the newest, so this is usually an append */
+	i = lower_bound(start + 1);
+	g_ptr_array_add(entries, NULL);
+	if (i < entries->len - 1)
+		memmove(entries->pdata + i + 1, entries->pdata + i,
+				(entries->len - 1 - i) * sizeof(gpointer));
+	g_ptr_array_index(entries, i) = entry;
+
+	return entry;
+}
+
+static void
+remove_entry(log_index_entry_t *entry)
+{
+	char *key;
+
+	key = entry_key(entry->protocol, entry->username, entry->type, entry->name,
+			entry->start);
+	g_hash_table_remove(entry_table, key);
+	g_free(key);
+
+	g_queue_remove(unindexed, entry);
+	g_ptr_array_remove(entries, entry);
+	entry_free(entry);
+}
+
+/* The file that holds a log and nothing else, or NULL if there is none. */
+const char *
+log_index_log_path(PurpleLog *log)
+{
+	PurpleLogCommonLoggerData *data = log->logger_data;
+
+	/* the html and txt loggers keep each log in a file of its own, the
+	   old logger keeps all of them in one */
+	if (data == NULL || log->logger == NULL || log->logger->id == NULL ||
+			(strcmp(log->logger->id, "html") && strcmp(log->logger->id, "txt")))
+		return NULL;
+	return data->path;
+}
+
+static void
+remember_logger(PurpleLogLogger *logger)
+{
+	if (logger == NULL || logger->id == NULL)
+		return;
+
+	if (!strcmp(logger->id, "html"))
+		html_logger = logger;
+	else if (!strcmp(logger->id, "txt"))
+		txt_logger = logger;
+}
+
+/* The logger an entry's log was written by, if it is one of those that
+   keep a file per log and it has been seen */
+static PurpleLogLogger *
+entry_logger(log_index_entry_t *entry)
+{
+	if (g_str_has_suffix(entry->path, ".html"))
+		return html_logger;
+	if (g_str_has_suffix(entry->path, ".txt"))
+		return txt_logger;
+	return NULL;
+}
+
+/* Whether the entry's file has its log and nothing else in it.  Indexes
+   from before the old logger was left out still have its file for each of
+   the logs in it. */
+static gboolean
+entry_has_file(log_index_entry_t *entry)
+{
+	return g_str_has_suffix(entry->path, ".html") ||
+			g_str_has_suffix(entry->path, ".txt");
+}
+
+/* Drops the tags from html in place, and decodes the entities the html
+ * logger writes.  purple_markup_strip_html() does more, but it can't be
+ * called from more than one thread at once. */
+static void
+strip_markup(char *html)
+{
+	static const struct {
+		const char *entity;
+		char c;
+	} entities[] = {
+		{ "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+		{ "&quot;", '"' }, { "&apos;", '\'' }, { "&nbsp;", ' ' }
+	};
+	char *in = html, *out = html, *end;
+	guint i;
+
+	while (*in) {
+		if (*in == '<' && (end = strchr(in, '>')) != NULL) {
+			if (!g_ascii_strncasecmp(in, "<br", 3))
+				*out++ = '\n';
+			in = end + 1;
+			continue;
+		}
+
+		if (*in == '&') {
+			for (i = 0; i < G_N_ELEMENTS(entities); i++)
+				if (!strncmp(in, entities[i].entity, strlen(entities[i].entity)))
+					break;
+			if (i < G_N_ELEMENTS(entities)) {
+				*out++ = entities[i].c;
+				in += strlen(entities[i].entity);
+				continue;
+			}
+		}
+
+		*out++ = *in++;
+	}
+	*out = '\0';
+}
+
+/* The text of a log's file from *offset on, the way it goes into the text
+ * index, or NULL if it can't be read.  Only whole lines are read, and
+ * *offset is moved past them, so a conversation's log is indexed as the
+ * logger writes it, just as if it were read in one go later.  It touches
+ * nothing else, so the search threads read the logs the text index doesn't
+ * have yet with it too. */
+char *
+log_index_read_text(const char *path, long *offset)
+{
+	GString *str;
+	char buf[4096], *text, *end;
+	gboolean header = *offset == 0;
+	size_t n;
+	FILE *fp;
+
+	if ((fp = g_fopen(path, "rb")) == NULL)
+		return NULL;
+	if (fseek(fp, *offset, SEEK_SET) != 0) {
+		fclose(fp);
+		return NULL;
+	}
+
+	str = g_string_new(NULL);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		g_string_append_len(str, buf, n);
+	fclose(fp);
+
+	/* a line that is still being written is left for next time */
+	end = g_strrstr_len(str->str, str->len, "\n");
+	g_string_truncate(str, end ? end + 1 - str->str : 0);
+	*offset += str->len;
+
+	/* like purple_log_read(), without the "Conversation with ..." line
+	   and the \r */
+	text = header ? strchr(str->str, '\n') : NULL;
+	text = g_strdup(text ? text + 1 : header ? "" : str->str);
+	g_string_free(str, TRUE);
+	purple_str_strip_char(text, '\r');
+
+	if (g_str_has_suffix(path, ".html"))
+		strip_markup(text);
+
+	return text;
+}
+
+static log_index_entry_t *
+add_log(PurpleLog *log, time_t end, int words)
+{
+	log_index_entry_t *entry;
+
+	remember_logger(log->logger);
+	entry = add_entry(next_id, words, log->type,
+			purple_account_get_protocol_id(log->account),
+			purple_account_get_username(log->account), log->name,
+			log->time, end, log_index_log_path(log));
+	if (entry->id == next_id)
+		next_id++;
+
+	return entry;
+}
+
+static log_index_entry_t *
+find_log(PurpleLog *log)
+{
+	log_index_entry_t *entry;
+	char *key;
+
+	key = entry_key(purple_account_get_protocol_id(log->account),
+			purple_account_get_username(log->account), log->type, log->name,
+			log->time);
+	entry = g_hash_table_lookup(entry_table, key);
+	g_free(key);
+
+	return entry;
+}
+
+static gboolean
+save_index(gpointer null)
+{
+	GString *str;
+	char *stamp;
+	guint i;
+
+	save_timer = 0;
+
+	/* ties the two files together; the text index on disk hasn't changed
+	   if it hasn't been loaded */
+	if (text_loaded)
+		stamp = g_strdup_printf("%lu.%u", (unsigned long)time(NULL), next_id);
+	else
+		stamp = g_strdup(text_stamp ? text_stamp : "");
+
+	str = g_string_sized_new(entries->len * 128);
+	g_string_append_printf(str, INDEX_VERSION " %u %s\n", next_id, stamp);
+
+	for (i = 0; i < entries->len; i++) {
+		log_index_entry_t *entry = g_ptr_array_index(entries, i);
+		char *protocol = g_strescape(entry->protocol, NULL);
+		char *username = g_strescape(entry->username, NULL);
+		char *name = g_strescape(entry->name, NULL);
+		char *path = g_strescape(entry->path, NULL);
+
+		g_string_append_printf(str, "%u\t%d\t%ld\t%lu\t%lu\t%d\t%s\t%s\t%s\t%s\n",
+				entry->id, entry->words, entry->read,
+				(unsigned long)entry->start, (unsigned long)entry->end,
+				entry->type, protocol, username, name, path);
+
+		g_free(protocol);
+		g_free(username);
+		g_free(name);
+		g_free(path);
+	}
+
+	purple_util_write_data_to_file(INDEX_FILE, str->str, str->len);
+	g_string_free(str, TRUE);
+
+	if (text_loaded)
+		text_index_save(stamp);
+	g_free(stamp);
+
+	return FALSE;
+}
+
+static void
+schedule_save(void)
+{
+	if (save_timer == 0)
+		save_timer = purple_timeout_add(SAVE_DELAY, save_index, NULL);
+}
+
+static gboolean
+load_index(void)
+{
+	char *filename, *contents, *stamp;
+	char **lines, **header;
+	int i;
+
+	filename = g_build_filename(purple_user_dir(), INDEX_FILE, NULL);
+	if (!g_file_get_contents(filename, &contents, NULL, NULL)) {
+		g_free(filename);
+		return FALSE;
+	}
+	g_free(filename);
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	if (lines[0] == NULL || strncmp(lines[0], INDEX_VERSION " ", strlen(INDEX_VERSION " "))) {
+		tl_debug("ignoring log index of an unknown version\n");
+		g_strfreev(lines);
+		return FALSE;
+	}
+
+	header = g_strsplit(lines[0] + strlen(INDEX_VERSION " "), " ", 2);
+	next_id = header[0] ? strtoul(header[0], NULL, 10) : 0;
+	stamp = header[0] && header[1] ? header[1] : "";
+	/* the stamp starts with the time it was saved */
+	save_time = strtoul(stamp, NULL, 10);
+
+	/* the text index is loaded when it's needed */
+	g_free(text_stamp);
+	text_stamp = g_strdup(stamp);
+	g_strfreev(header);
+
+	for (i = 1; lines[i] != NULL; i++) {
+		char **field = g_strsplit(lines[i], "\t", 10);
+		int n;
+
+		for (n = 0; field[n] != NULL; n++)
+			;
+
+		if (n == 10) {
+			char *protocol = g_strcompress(field[6]);
+			char *username = g_strcompress(field[7]);
+			char *name = g_strcompress(field[8]);
+			char *path = g_strcompress(field[9]);
+			guint id = strtoul(field[0], NULL, 10);
+			log_index_entry_t *entry;
+
+			entry = add_entry(id, atoi(field[1]), atoi(field[5]),
+					protocol, username, name, strtoul(field[3], NULL, 10),
+					strtoul(field[4], NULL, 10), path);
+			entry->read = atol(field[2]);
+			if (id >= next_id)
+				next_id = id + 1;
+
+			g_free(protocol);
+			g_free(username);
+			g_free(name);
+			g_free(path);
+		}
+
+		g_strfreev(field);
+	}
+
+	g_strfreev(lines);
+
+	tl_debug("loaded %u logs from the log index\n", entries->len);
+	return TRUE;
+}
+
+static void
+rebuild_log_set(gpointer key, gpointer value, gpointer data)
+{
+	PurpleLogSet *set = value;
+	GList *logs, *l;
+	struct stat st;
+	time_t next = time(NULL), end;
+
+	if (set->account == NULL)
+		return;
+
+	/* newest first */
+	logs = purple_log_get_logs(set->type, set->name, set->account);
+
+	for (l = logs; l != NULL; l = l->next) {
+		PurpleLog *log = l->data;
+		const char *path = log_index_log_path(log);
+
+		/* the file was last written when the log ended, unless it has
+		   been copied since; then, it ended before the next one started */
+		end = log->time;
+		if (path && g_stat(path, &st) == 0)
+			end = CLAMP(st.st_mtime, log->time,
+					MAX(log->time, MIN(next, log->time + MAX_LOG_SPAN)));
+		add_log(log, end, -1);
+
+		next = log->time;
+		purple_log_free(log);
+	}
+
+	g_list_free(logs);
+}
+
+/* Reads one log that is not in the text index yet into it. */
+static gboolean
+index_next_log(gpointer null)
+{
+	log_index_entry_t *entry;
+	char *text;
+
+	/* they wait for the text index */
+	if (!text_loaded || (entry = g_queue_pop_head(unindexed)) == NULL) {
+		index_idle = 0;
+		return FALSE;
+	}
+
+	if (entry->words < 0 && entry_has_file(entry)) {
+		entry->read = 0;
+		text = log_index_read_text(entry->path, &entry->read);
+		if (text == NULL)
+			return TRUE;
+
+		entry->words = text_index_add(entry->id, 0, text);
+		g_free(text);
+		schedule_save();
+	}
+
+	return TRUE;
+}
+
+static gint
+compare_id(gconstpointer a, gconstpointer b)
+{
+	guint x = (*(log_index_entry_t **)a)->id;
+	guint y = (*(log_index_entry_t **)b)->id;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Queues every log with no text in the text index that has a file to read. */
+static void
+queue_unindexed(void)
+{
+	GPtrArray *queue = g_ptr_array_new();
+	guint i;
+
+	while (g_queue_pop_head(unindexed))
+		;
+
+	for (i = 0; i < entries->len; i++) {
+		log_index_entry_t *entry = g_ptr_array_index(entries, i);
+
+		if (entry->words < 0 && entry_has_file(entry))
+			g_ptr_array_add(queue, entry);
+	}
+
+	/* by id, so the text index only has to append to its lists; a rebuild
+	   numbers the logs newest first, those are the likeliest to be searched */
+	g_ptr_array_sort(queue, compare_id);
+	for (i = 0; i < queue->len; i++)
+		g_queue_push_tail(unindexed, g_ptr_array_index(queue, i));
+	g_ptr_array_free(queue, TRUE);
+
+	if (!g_queue_is_empty(unindexed) && index_idle == 0)
+		index_idle = g_idle_add(index_next_log, NULL);
+}
+
+/* Lists a log set again, adding the logs that are new and dropping those
+ * whose file is gone. */
+static void
+rescan_log_set(PurpleLogSet *set)
+{
+	const char *protocol = purple_account_get_protocol_id(set->account);
+	const char *username = purple_account_get_username(set->account);
+	char *name = g_strdup(purple_normalize(set->account, set->name));
+	guint i = 0;
+
+	rebuild_log_set(NULL, set, NULL);
+
+	while (i < entries->len) {
+		log_index_entry_t *entry = g_ptr_array_index(entries, i);
+
+		if (entry->type == set->type && *entry->path &&
+				!strcmp(entry->protocol, protocol) &&
+				!strcmp(entry->username, username) &&
+				!strcmp(purple_normalize(set->account, entry->name), name) &&
+				!g_file_test(entry->path, G_FILE_TEST_EXISTS))
+			remove_entry(entry);
+		else
+			i++;
+	}
+
+	g_free(name);
+	schedule_save();
+}
+
+static void
+collect_log_set(gpointer key, gpointer value, gpointer data)
+{
+	unchecked = g_list_prepend(unchecked, value);
+}
+
+/* Checks one log set against the index.  Adding or deleting a log touches
+ * the directory the set's logs are in, so only the sets whose directory
+ * changed after the index was saved are listed again. */
+static gboolean
+check_next_set(gpointer null)
+{
+	PurpleLogSet *set;
+	struct stat st;
+	char *dir;
+
+	if (log_sets == NULL) {
+		log_sets = purple_log_get_log_sets();
+		g_hash_table_foreach(log_sets, collect_log_set, NULL);
+	}
+
+	if (unchecked == NULL) {
+		g_hash_table_destroy(log_sets);
+		log_sets = NULL;
+		check_idle = 0;
+
+		/* and the new logs go into the text index */
+		queue_unindexed();
+		return FALSE;
+	}
+
+	set = unchecked->data;
+	unchecked = g_list_delete_link(unchecked, unchecked);
+
+	if (set->account == NULL)
+		return TRUE;
+
+	dir = purple_log_get_log_dir(set->type, set->name, set->account);
+	if (dir != NULL && g_stat(dir, &st) == 0 && st.st_mtime >= save_time) {
+		tl_debug("%s changed since the log index was saved\n", dir);
+		rescan_log_set(set);
+	}
+	g_free(dir);
+
+	return TRUE;
+}
+
+static void
+stop_check(void)
+{
+	if (check_idle) {
+		g_source_remove(check_idle);
+		check_idle = 0;
+	}
+
+	g_list_free(unchecked);
+	unchecked = NULL;
+	if (log_sets != NULL) {
+		g_hash_table_destroy(log_sets);
+		log_sets = NULL;
+	}
+}
+
+void
+log_index_rebuild(void)
+{
+	GHashTable *log_sets;
+	guint i;
+
+	/* every set is listed here anyway */
+	stop_check();
+	clear_entries();
+	text_index_clear();
+	text_loaded = TRUE;
+	g_free(text_stamp);
+	text_stamp = NULL;
+
+	log_sets = purple_log_get_log_sets();
+	g_hash_table_foreach(log_sets, rebuild_log_set, NULL);
+	g_hash_table_destroy(log_sets);
+
+	/* the text index is empty, so the ids can start over, newest first */
+	for (i = 0; i < entries->len; i++)
+		((log_index_entry_t *)g_ptr_array_index(entries, i))->id = entries->len - 1 - i;
+	next_id = entries->len;
+
+	built = TRUE;
+	tl_debug("indexed %u logs\n", entries->len);
+
+	if (save_timer) {
+		purple_timeout_remove(save_timer);
+		save_timer = 0;
+	}
+	save_index(NULL);
+
+	queue_unindexed();
+}
+
+static void
+wrote_msg_cb(PurpleAccount *account, const char *who, const char *message,
+		PurpleConversation *conv, PurpleMessageFlags flags)
+{
+	log_index_entry_t *entry;
+	PurpleLog *log;
+	char *text;
+
+	/* purple_conversation_write() only logs these when it is logging, and
+	   not the ones asked not to be, such as OTR's */
+	if (!built || (flags & PURPLE_MESSAGE_NO_LOG) ||
+			!purple_conversation_is_logging(conv) || conv->logs == NULL)
+		return;
+
+	/* the log being written to is the first one.  If it was started before
+	   we were loaded, what is already in it gets read in later */
+	log = conv->logs->data;
+	entry = add_log(log, time(NULL),
+			text_loaded && log->time >= load_time ? 0 : -1);
+
+	/* a log without a file of its own isn't in the text index at all */
+	if (!entry_has_file(entry)) {
+		schedule_save();
+		return;
+	}
+
+	if (entry->words >= 0 && text_loaded) {
+		/* what the logger wrote, with the alias and the time, so it is
+		   indexed the same as when the whole log is read in */
+		text = log_index_read_text(entry->path, &entry->read);
+		if (text != NULL) {
+			entry->words = text_index_add(entry->id, entry->words, text);
+			g_free(text);
+		}
+	} else if (entry->words < 0 && g_queue_find(unindexed, entry) == NULL) {
+		g_queue_push_head(unindexed, entry);
+		if (index_idle == 0)
+			index_idle = g_idle_add(index_next_log, NULL);
+	}
+
+	schedule_save();
+}
+
+static gint
+compare_score(gconstpointer a, gconstpointer b, gpointer data)
+{
+	gdouble x = *(gdouble *)g_hash_table_lookup(data, a);
+	gdouble y = *(gdouble *)g_hash_table_lookup(data, b);
+
+	return x > y ? -1 : x < y;
+}
+
+/* Ranks the logs that have the words of query in them, best first, and
+ * puts those whose text isn't in the text index in *rest.  If the query has
+ * no words at all, nothing matches. */
+/* Loads the text index.  Without the one that goes with the log index, all
+ * the text is indexed again. */
+static void
+load_text_index(void)
+{
+	guint i;
+
+	text_loaded = TRUE;
+	if (text_stamp == NULL || !text_index_load(text_stamp)) {
+		for (i = 0; i < entries->len; i++) {
+			log_index_entry_t *entry = g_ptr_array_index(entries, i);
+
+			entry->words = -1;
+			entry->read = 0;
+		}
+	}
+	g_free(text_stamp);
+	text_stamp = NULL;
+
+	queue_unindexed();
+}
+
+GList *
+log_index_search(GList *logs, const char *query, GList **rest)
+{
+	GHashTable *scores, *log_scores;
+	GList *found = NULL, *l;
+	guint i, n_logs = 0;
+	gdouble *score;
+
+	*rest = NULL;
+
+	if (!text_loaded)
+		load_text_index();
+
+	for (i = 0; i < entries->len; i++)
+		if (((log_index_entry_t *)g_ptr_array_index(entries, i))->words >= 0)
+			n_logs++;
+
+	scores = text_index_search(query, n_logs);
+	if (scores == NULL)
+		return NULL;
+
+	log_scores = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	for (l = logs; l != NULL; l = l->next) {
+		log_index_entry_t *entry = find_log(l->data);
+
+		if (entry == NULL || entry->words < 0) {
+			*rest = g_list_prepend(*rest, l->data);
+		} else if ((score = g_hash_table_lookup(scores, GUINT_TO_POINTER(entry->id)))) {
+			g_hash_table_insert(log_scores, l->data, score);
+			found = g_list_prepend(found, l->data);
+		}
+	}
+
+	found = g_list_sort_with_data(found, compare_score, log_scores);
+	g_hash_table_destroy(log_scores);
+	g_hash_table_destroy(scores);
+
+	*rest = g_list_reverse(*rest);
+	return found;
+}
+
+/* The log an entry is about, made up from the index without listing the
+ * log set, or NULL if that can't be done. */
+static PurpleLog *
+entry_log(log_index_entry_t *entry, PurpleAccount *account)
+{
+	PurpleLogLogger *logger = entry_logger(entry);
+	PurpleLogCommonLoggerData *data;
+	PurpleLog *log;
+
+	if (logger == NULL)
+		return NULL;
+
+	log = purple_log_new(entry->type, entry->name, account, NULL, entry->start, NULL);
+
+	/* the way the html and txt listers make them */
+	data = g_slice_new0(PurpleLogCommonLoggerData);
+	data->path = g_strdup(entry->path);
+	log->logger = logger;
+	log->logger_data = data;
+
+	return log;
+}
+
+static void
+collect_entry(gpointer key, gpointer value, gpointer data)
+{
+	GList **list = data;
+
+	*list = g_list_prepend(*list, value);
+}
+
+/* by buddy, which is how the viewer groups them, then newest first */
+static gint
+compare_log(gconstpointer a, gconstpointer b)
+{
+	int ret = strcmp(((PurpleLog *)a)->name, ((PurpleLog *)b)->name);
+
+	return ret ? ret : purple_log_compare(a, b);
+}
+
+GList *
+log_index_query(PurpleAccount *account, time_t start, time_t end)
+{
+	GHashTable *sets, *made;
+	GList *result = NULL, *to_list = NULL, *logs;
+	PurpleLogLogger *current = purple_log_logger_get();
+	const char *protocol, *username;
+	gboolean direct;
+	guint i;
+
+	if (!built)
+		log_index_rebuild();
+
+	protocol = purple_account_get_protocol_id(account);
+	username = purple_account_get_username(account);
+
+	/* purple_log_new() would let the current logger set up a log of its
+	   own, so if it does that every set is listed */
+	direct = current == NULL || current->create == NULL;
+
+	/* the log sets that have to be listed, set -> an entry in it */
+	sets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	/* the entries whose logs were made up */
+	made = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	/* a log that started before the range may still run into it */
+	i = lower_bound(start > longest ? start - longest : 0);
+
+	for (; i < entries->len; i++) {
+		log_index_entry_t *entry = g_ptr_array_index(entries, i);
+		PurpleLog *log;
+		char *set;
+
+		if (entry->start > end)
+			break;
+		if (entry->end < start)
+			continue;
+		if (strcmp(entry->protocol, protocol) || strcmp(entry->username, username))
+			continue;
+
+		if (direct && (log = entry_log(entry, account)) != NULL) {
+			g_hash_table_insert(made, entry, entry);
+			result = g_list_prepend(result, log);
+			continue;
+		}
+
+		set = g_strdup_printf("%d\t%s", entry->type, purple_normalize(account, entry->name));
+		if (g_hash_table_lookup(sets, set))
+			g_free(set);
+		else
+			g_hash_table_insert(sets, set, entry);
+	}
+
+	/* the sets with logs that can't be made up, like the old logger's */
+	g_hash_table_foreach(sets, collect_entry, &to_list);
+	while (to_list != NULL) {
+		log_index_entry_t *entry = to_list->data;
+
+		logs = purple_log_get_logs(entry->type, entry->name, account);
+		while (logs != NULL) {
+			PurpleLog *log = logs->data;
+			log_index_entry_t *found = find_log(log);
+
+			remember_logger(log->logger);
+
+			if (found == NULL ? log->time >= start && log->time <= end :
+					found->start <= end && found->end >= start &&
+					g_hash_table_lookup(made, found) == NULL)
+				result = g_list_prepend(result, log);
+			else
+				purple_log_free(log);
+
+			logs = g_list_delete_link(logs, logs);
+		}
+
+		to_list = g_list_delete_link(to_list, to_list);
+	}
+
+	g_hash_table_destroy(made);
+	g_hash_table_destroy(sets);
+
+	return g_list_sort(result, compare_log);
+}
+
+void
+log_index_init(PurplePlugin *plugin)
+{
+	void *conv_handle = purple_conversations_get_handle();
+
+	entries = g_ptr_array_new();
+	entry_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	unindexed = g_queue_new();
+	text_index_init();
+
+	load_time = time(NULL);
+	next_id = 0;
+	built = load_index();
+	if (built) {
+		queue_unindexed();
+		check_idle = g_idle_add(check_next_set, NULL);
+	}
+	remember_logger(purple_log_logger_get());
+
+	purple_signal_connect(conv_handle, "wrote-im-msg", plugin,
+			PURPLE_CALLBACK(wrote_msg_cb), NULL);
+	purple_signal_connect(conv_handle, "wrote-chat-msg", plugin,
+			PURPLE_CALLBACK(wrote_msg_cb), NULL);
+}
+
+void
+log_index_uninit(void)
+{
+	if (save_timer) {
+		purple_timeout_remove(save_timer);
+		save_index(NULL);
+	}
+
+	if (index_idle) {
+		g_source_remove(index_idle);
+		index_idle = 0;
+	}
+
+	stop_check();
+	clear_entries();
+	g_ptr_array_free(entries, TRUE);
+	g_hash_table_destroy(entry_table);
+	g_queue_free(unindexed);
+	text_index_uninit();
+	g_free(text_stamp);
+	text_stamp = NULL;
+	text_loaded = FALSE;
+	entries = NULL;
+	entry_table = NULL;
+	unindexed = NULL;
+	built = FALSE;
+}
@@ -0,0 +1,34 @@
+/*
+ * TimeLog plugin.
+ *
+ * Copyright (C) 2006 Jon Oberheide.
+ * Copyright (C) 2007-2008 Stu Tomlinson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _LOG_INDEX_H_
+#define _LOG_INDEX_H_
+
+void log_index_init(PurplePlugin *plugin);
+void log_index_uninit(void);
+void log_index_rebuild(void);
+GList *log_index_query(PurpleAccount *account, time_t start, time_t end);
+GList *log_index_search(GList *logs, const char *query, GList **rest);
+const char *log_index_log_path(PurpleLog *log);
+char *log_index_read_text(const char *path, long *offset);
+
+#endif
@@ -43,9 +43,40 @@
 #include <util.h>
 
 #include "timelog.h"
+#include "log-index.h"
 #include "log-widget.h"
+#include "text-index.h"
+
+/* how many logs are read at once when searching */
+#define SEARCH_THREADS	2
+
+/*
+ * A search through the logs the text index doesn't have.  Those with a file
+ * of their own are read and searched by a pool of threads, which queue the
+ * ones that match; the rest need purple_log_read(), so they are read here,
+ * one at a time.  A timeout moves the matches into the tree and updates the
+ * progress bar.
+ */
+typedef struct {
+	GThreadPool *pool;
+	GAsyncQueue *results;	/* of PurpleLog *, the logs that matched */
+	char *term;
+	volatile gint cancelled;
+	volatile gint done;		/* logs searched so far */
+	guint total;
+	GList *unread;			/* logs searched on the main thread */
+	guint timer;
+} search_job_t;
+
+typedef struct {
+	PurpleLog *log;
+	char *path;
+} search_task_t;
 
 static PidginLogViewer *syslog_viewer = NULL;
+static search_job_t *search_job = NULL;
+static GtkWidget *search_progress = NULL;
+static GtkWidget *search_cancel = NULL;
 
 static gint
 log_compare(gconstpointer y, gconstpointer z)
@@ -96,12 +127,131 @@ populate_log_tree(PidginLogViewer *lv)
 	}
 }
 
+static void
+add_search_result(PidginLogViewer *lv, PurpleLog *log)
+{
+	GtkTreeIter iter;
+	char title[64];
+	char *title_utf8; /* temporary variable for utf8 conversion */
+
+	strftime(title, sizeof(title), "%c", localtime(&log->time));
+	title_utf8 = purple_utf8_try_convert(title);
+	strncpy(title, title_utf8, sizeof(title));
+	g_free(title_utf8);
+
+	gtk_tree_store_append (lv->treestore, &iter, NULL);
+	gtk_tree_store_set(lv->treestore, &iter,
+			   0, title,
+			   1, log, -1);
+}
+
+static void
+search_worker(gpointer data, gpointer user_data)
+{
+	search_task_t *task = data;
+	search_job_t *job = user_data;
+	long offset = 0;
+	char *text;
+
+	/* matched the way the text index would match it */
+	if (!g_atomic_int_get(&job->cancelled) &&
+			(text = log_index_read_text(task->path, &offset)) != NULL) {
+		if (text_index_match(text, job->term))
+			g_async_queue_push(job->results, task->log);
+		g_free(text);
+	}
+
+	g_atomic_int_inc(&job->done);
+
+	g_free(task->path);
+	g_free(task);
+}
+
+static void
+search_stop(PidginLogViewer *lv)
+{
+	search_job_t *job = search_job;
+
+	if (job == NULL)
+		return;
+	search_job = NULL;
+
+	/* the logs that haven't been started are still handed to the threads,
+	   which only free them once cancelled is set; this waits for them all */
+	g_atomic_int_set(&job->cancelled, TRUE);
+	if (job->pool)
+		g_thread_pool_free(job->pool, FALSE, TRUE);
+
+	purple_timeout_remove(job->timer);
+	g_async_queue_unref(job->results);
+	g_list_free(job->unread);
+	g_free(job->term);
+	g_free(job);
+
+	gtk_widget_hide(search_progress);
+	gtk_widget_hide(search_cancel);
+	if (lv->window->window != NULL)
+		gdk_window_set_cursor(lv->window->window, NULL);
+}
+
+static gboolean
+search_tick(gpointer data)
+{
+	PidginLogViewer *lv = data;
+	search_job_t *job = search_job;
+	PurpleLog *log;
+	char *text, *stripped;
+	guint done;
+
+	if (job->unread != NULL) {
+		log = job->unread->data;
+		job->unread = g_list_delete_link(job->unread, job->unread);
+
+		text = purple_log_read(log, NULL);
+		stripped = purple_markup_strip_html(text ? text : "");
+		if (text_index_match(stripped, job->term))
+			add_search_result(lv, log);
+		g_free(stripped);
+		g_free(text);
+		g_atomic_int_inc(&job->done);
+	}
+
+	/* the threads queue a match before counting the log as done, so once
+	   they are all done the queue holds every match that's left */
+	done = g_atomic_int_get(&job->done);
+
+	while ((log = g_async_queue_try_pop(job->results)) != NULL)
+		add_search_result(lv, log);
+
+	if (done >= job->total) {
+		search_stop(lv);
+		return FALSE;
+	}
+
+	text = g_strdup_printf(_("Searched %u of %u logs"), done, job->total);
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(search_progress), text);
+	gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(search_progress),
+			(gdouble)done / job->total);
+	g_free(text);
+
+	return TRUE;
+}
+
+static void
+search_cancel_cb(GtkWidget *button, PidginLogViewer *lv)
+{
+	search_stop(lv);
+}
+
 static void
 search_cb(GtkWidget *button, PidginLogViewer *lv)
 {
 	const char *search_term = gtk_entry_get_text(GTK_ENTRY(lv->entry));
-	GList *logs;
+	GList *logs, *found, *rest;
 	GdkCursor *cursor;
+	search_job_t *job;
+
+	search_stop(lv);
 
 	if (lv->search != NULL)
 		g_free(lv->search);
@@ -117,34 +267,50 @@ search_cb(GtkWidget *button, PidginLogViewer *lv)
 
 	lv->search = g_strdup(search_term);
 
-	cursor = gdk_cursor_new(GDK_WATCH);
-	gdk_window_set_cursor(lv->window->window, cursor);
-	gdk_cursor_unref(cursor);
-	while (gtk_events_pending())
-		gtk_main_iteration();
-
-	for (logs = lv->logs; logs != NULL; logs = logs->next) {
-		char *read = purple_log_read((PurpleLog*)logs->data, NULL);
-		if (read && *read && purple_strcasestr(read, search_term)) {
-			GtkTreeIter iter;
-			PurpleLog *log = logs->data;
-			char title[64];
-			char *title_utf8; /* temporary variable for utf8 conversion */
-
-			strftime(title, sizeof(title), "%c", localtime(&log->time));
-			title_utf8 = purple_utf8_try_convert(title);
-			strncpy(title, title_utf8, sizeof(title));
-			g_free(title_utf8);
-
-			gtk_tree_store_append (lv->treestore, &iter, NULL);
-			gtk_tree_store_set(lv->treestore, &iter,
-					   0, title,
-					   1, log, -1);
+	/* the text index has the best matches first */
+	found = log_index_search(lv->logs, search_term, &rest);
+	for (logs = found; logs != NULL; logs = logs->next)
+		add_search_result(lv, logs->data);
+	g_list_free(found);
+
+	if (rest == NULL)
+		return;
+
+	/* the logs it doesn't have yet are searched the slow way, in the
+	   background */
+	job = g_new0(search_job_t, 1);
+	job->results = g_async_queue_new();
+	job->term = g_strdup(search_term);
+	job->total = g_list_length(rest);
+	job->pool = g_thread_pool_new(search_worker, job, SEARCH_THREADS, FALSE, NULL);
+
+	for (logs = rest; logs != NULL; logs = logs->next) {
+		const char *path = log_index_log_path(logs->data);
+
+		if (job->pool != NULL && path != NULL) {
+			search_task_t *task = g_new0(search_task_t, 1);
+
+			task->log = logs->data;
+			task->path = g_strdup(path);
+			g_thread_pool_push(job->pool, task, NULL);
+		} else {
+			job->unread = g_list_prepend(job->unread, logs->data);
 		}
-		g_free(read);
 	}
+	job->unread = g_list_reverse(job->unread);
+	g_list_free(rest);
 
-	gdk_window_set_cursor(lv->window->window, NULL);
+	search_job = job;
+	job->timer = purple_timeout_add(100, search_tick, lv);
+
+	gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(search_progress), 0.0);
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(search_progress), NULL);
+	gtk_widget_show(search_progress);
+	gtk_widget_show(search_cancel);
+
+	cursor = gdk_cursor_new(GDK_WATCH);
+	gdk_window_set_cursor(lv->window->window, cursor);
+	gdk_cursor_unref(cursor);
 }
 
 static gboolean
@@ -153,6 +319,9 @@ destroy_cb(GtkWidget *w, gint resp, gpointer data)
 	PidginLogViewer *lv = syslog_viewer;
 	syslog_viewer = NULL;
 
+	/* the search may still be looking at the logs */
+	search_stop(lv);
+
 	while (lv->logs != NULL) {
 		GList *logs2;
 
@@ -212,8 +381,7 @@ log_select_cb(GtkTreeSelection *sel, PidginLogViewer *viewer)
 		cursor = gdk_cursor_new(GDK_WATCH);
 		gdk_window_set_cursor(viewer->window->window, cursor);
 		gdk_cursor_unref(cursor);
-		while (gtk_events_pending())
-			gtk_main_iteration();
+		gdk_flush();
 	}
 
 	if (log->type != PURPLE_LOG_SYSTEM) {
@@ -365,6 +533,15 @@ log_widget_display_logs(GList *logs)
 	g_signal_connect(GTK_BUTTON(button), "activate", G_CALLBACK(search_cb), lv);
 	g_signal_connect(GTK_BUTTON(button), "clicked", G_CALLBACK(search_cb), lv);
 
+	/* shown while a search is running */
+	search_progress = gtk_progress_bar_new();
+	gtk_widget_set_no_show_all(search_progress, TRUE);
+	gtk_box_pack_start(GTK_BOX(hbox), search_progress, FALSE, FALSE, 0);
+	search_cancel = gtk_button_new_from_stock(GTK_STOCK_CANCEL);
+	gtk_widget_set_no_show_all(search_cancel, TRUE);
+	gtk_box_pack_start(GTK_BOX(hbox), search_cancel, FALSE, FALSE, 0);
+	g_signal_connect(GTK_BUTTON(search_cancel), "clicked", G_CALLBACK(search_cancel_cb), lv);
+
 #if GTK_CHECK_VERSION(2,2,0)
 	/* Show most recent log **********/
 	path_to_first_log = gtk_tree_path_new_from_string("0:0");
@@ -0,0 +1,734 @@
+/*
+ * TimeLog plugin.
+ *
+ * Copyright (C) 2006 Jon Oberheide.
+ * Copyright (C) 2007-2008 Stu Tomlinson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * A full text index of the logs: every word, casefolded, maps to the list
+ * of places it occurs, as (log id, word position) pairs sorted by id and
+ * then position.  The log ids are the ones the log index hands out.  It
+ * lives in timelog.terms in the user's directory, as
+ *
+ *     "timelog-terms 1 " stamp "\n"
+ *
+ * followed, for each word, by the word and a NUL, the number of places as
+ * a 32-bit little endian number, and the places as pairs of them.
+ *
+ * Writing all of that out every time a few messages were logged would be
+ * slow, so the places added since are appended to timelog.terms-add, as
+ *
+ *     "timelog-terms-add 1 " stamp of timelog.terms "\n"
+ *
+ * and then the word, a NUL and the place for each of them.  Each save ends
+ * with an empty word and the stamp it was made with, and a NUL.  Once that
+ * file is half the size of timelog.terms, the two are written out as one.
+ * The stamp has to match the log index's, or the two are out of step and
+ * the text is indexed again.
+ */
+
+/* If you can't figure out what this line is for, DON'T TOUCH IT. */
+#include "../common/pp_internal.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <debug.h>
+#include <util.h>
+
+#include "timelog.h"
+#include "text-index.h"
+
+#if GLIB_CHECK_VERSION(2,6,0)
+#include <glib/gstdio.h>
+#else
+#include <unistd.h>
+#define g_fopen fopen
+#define g_unlink unlink
+#endif
+
+#define TERMS_FILE		"timelog.terms"
+#define TERMS_VERSION	"timelog-terms 1"
+#define ADDED_FILE		"timelog.terms-add"
+#define ADDED_VERSION	"timelog-terms-add 1"
+
+/* longer words are most likely links or noise, so they are not indexed */
+#define MAX_TERM_LEN	64
+
+typedef struct {
+	guint32 id;
+	guint32 pos;
+} posting_t;
+
+static GHashTable *terms = NULL;	/* word -> GArray of posting_t, sorted */
+static GString *added = NULL;		/* the places added since the last save */
+static char *base_stamp = NULL;		/* what timelog.terms was saved with, or NULL */
+static gsize base_length = 0;		/* of timelog.terms */
+static gsize added_length = 0;		/* of timelog.terms-add, or 0 to start it over */
+
+typedef void (*term_func)(const char *term, gpointer data);
+
+/* Calls func with each word of text, casefolded. */
+static void
+tokenize(const char *text, term_func func, gpointer data)
+{
+	const char *p = text, *start = NULL;
+	char *term;
+
+	for (;;) {
+		gunichar c = *p ? g_utf8_get_char_validated(p, -1) : 0;
+		gboolean word = c != 0 && c != (gunichar)-1 && c != (gunichar)-2 &&
+				g_unichar_isalnum(c);
+
+		if (word && start == NULL) {
+			start = p;
+		} else if (!word && start != NULL) {
+			if (p - start <= MAX_TERM_LEN) {
+				term = g_utf8_casefold(start, p - start);
+				func(term, data);
+				g_free(term);
+			}
+			start = NULL;
+		}
+
+		if (*p == '\0')
+			break;
+		if (c == (gunichar)-1 || c == (gunichar)-2)
+			p++;
+		else
+			p = g_utf8_next_char(p);
+	}
+}
+
+static void
+postings_free(gpointer data)
+{
+	g_array_free(data, TRUE);
+}
+
+void
+text_index_init(void)
+{
+	terms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, postings_free);
+	added = g_string_new(NULL);
+}
+
+void
+text_index_uninit(void)
+{
+	g_hash_table_destroy(terms);
+	g_string_free(added, TRUE);
+	g_free(base_stamp);
+	terms = NULL;
+	added = NULL;
+	base_stamp = NULL;
+	base_length = 0;
+	added_length = 0;
+}
+
+void
+text_index_clear(void)
+{
+	text_index_uninit();
+	text_index_init();
+}
+
+static gint
+posting_compare(gconstpointer a, gconstpointer b)
+{
+	const posting_t *x = a, *y = b;
+
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/* Puts a place where it belongs in the word's list.  It is nearly always
+ * the last, as it's in the log being written to or the one being read. */
+static void
+add_posting(const char *term, const posting_t *posting)
+{
+	GArray *postings = g_hash_table_lookup(terms, term);
+	guint lo = 0, hi, mid;
+
+	if (postings == NULL) {
+		postings = g_array_new(FALSE, FALSE, sizeof(posting_t));
+		g_hash_table_insert(terms, g_strdup(term), postings);
+	}
+
+	hi = postings->len;
+	if (hi == 0 || posting_compare(&g_array_index(postings, posting_t, hi - 1),
+				posting) < 0) {
+		g_array_append_vals(postings, posting, 1);
+		return;
+	}
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (posting_compare(&g_array_index(postings, posting_t, mid), posting) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	g_array_insert_vals(postings, lo, posting, 1);
+}
+
+static void
+append_u32(GString *str, guint32 n)
+{
+	n = GUINT32_TO_LE(n);
+	g_string_append_len(str, (char *)&n, sizeof(n));
+}
+
+typedef struct {
+	guint id;
+	int pos;
+} add_state_t;
+
+static void
+add_term(const char *term, gpointer data)
+{
+	add_state_t *state = data;
+	posting_t posting;
+
+	posting.id = state->id;
+	posting.pos = state->pos++;
+	add_posting(term, &posting);
+
+	/* for the next save */
+	g_string_append_len(added, term, strlen(term) + 1);
+	append_u32(added, posting.id);
+	append_u32(added, posting.pos);
+}
+
+/* Indexes the words of text, the first of them at word position pos of the
+ * log, and returns the position after the last one. */
+int
+text_index_add(guint id, int pos, const char *text)
+{
+	add_state_t state;
+
+	state.id = id;
+	state.pos = pos;
+	tokenize(text, add_term, &state);
+
+	return state.pos;
+}
+
+static void
+save_term(gpointer key, gpointer value, gpointer data)
+{
+	GArray *postings = value;
+	GString *str = data;
+	guint i;
+
+	g_string_append_len(str, key, strlen(key) + 1);
+	append_u32(str, postings->len);
+
+	for (i = 0; i < postings->len; i++) {
+		posting_t *posting = &g_array_index(postings, posting_t, i);
+
+		append_u32(str, posting->id);
+		append_u32(str, posting->pos);
+	}
+}
+
+/* Writes out the whole index, and starts timelog.terms-add over. */
+static void
+save_all(const char *stamp)
+{
+	GString *str = g_string_sized_new(MAX(base_length, 1024 * 1024));
+	char *filename;
+
+	g_string_append_printf(str, TERMS_VERSION " %s\n", stamp);
+	g_hash_table_foreach(terms, save_term, str);
+
+	g_free(base_stamp);
+	base_stamp = NULL;
+	if (purple_util_write_data_to_file(TERMS_FILE, str->str, str->len)) {
+		base_stamp = g_strdup(stamp);
+		base_length = str->len;
+	}
+	g_string_free(str, TRUE);
+
+	filename = g_build_filename(purple_user_dir(), ADDED_FILE, NULL);
+	g_unlink(filename);
+	g_free(filename);
+
+	g_string_truncate(added, 0);
+	added_length = 0;
+}
+
+/* Appends what was added since the last save to timelog.terms-add. */
+static gboolean
+save_added(const char *stamp)
+{
+	char *filename;
+	FILE *fp;
+	gboolean ok;
+	long length = -1;
+
+	filename = g_build_filename(purple_user_dir(), ADDED_FILE, NULL);
+	fp = g_fopen(filename, added_length ? "ab" : "wb");
+	g_free(filename);
+	if (fp == NULL)
+		return FALSE;
+
+	/* anything past where the last save ended is from one that failed, so
+	   it can't be added to */
+	if (added_length)
+		ok = fseek(fp, 0, SEEK_END) == 0 && ftell(fp) == (long)added_length;
+	else
+		ok = fprintf(fp, ADDED_VERSION " %s\n", base_stamp) > 0;
+
+	g_string_append_c(added, '\0');
+	g_string_append_len(added, stamp, strlen(stamp) + 1);
+
+	if (ok && fwrite(added->str, 1, added->len, fp) == added->len)
+		length = ftell(fp);
+	if (fclose(fp) != 0 || length < 0)
+		return FALSE;
+
+	g_string_truncate(added, 0);
+	added_length = length;
+	return TRUE;
+}
+
+void
+text_index_save(const char *stamp)
+{
+	/* only what is new is written, until there is a lot of it */
+	if (base_stamp != NULL && added_length + added->len < base_length / 2 &&
+			save_added(stamp))
+		return;
+
+	save_all(stamp);
+}
+
+static guint32
+read_u32(const char *p)
+{
+	guint32 n;
+
+	memcpy(&n, p, sizeof(n));
+	return GUINT32_FROM_LE(n);
+}
+
+/* Adds the places in timelog.terms-add saved after timelog.terms, up to the
+ * save that was made with stamp. */
+static gboolean
+load_added(const char *stamp)
+{
+	char *filename, *contents, *header, *p, *end;
+	gsize length;
+	gboolean ok = FALSE;
+
+	filename = g_build_filename(purple_user_dir(), ADDED_FILE, NULL);
+	if (!g_file_get_contents(filename, &contents, &length, NULL)) {
+		g_free(filename);
+		return FALSE;
+	}
+	g_free(filename);
+
+	end = contents + length;
+	header = g_strdup_printf(ADDED_VERSION " %s\n", base_stamp);
+
+	if (length < strlen(header) || strncmp(contents, header, strlen(header)))
+		goto out;
+
+	for (p = contents + strlen(header); p < end; ) {
+		char *term = p;
+		posting_t posting;
+
+		p = memchr(p, '\0', end - p);
+		if (p == NULL)
+			break;
+		p++;
+
+		if (*term == '\0') {
+			/* the end of a save */
+			char *saved = p;
+
+			p = memchr(p, '\0', end - p);
+			if (p == NULL)
+				break;
+			p++;
+
+			if (!strcmp(saved, stamp)) {
+				added_length = p - contents;
+				ok = TRUE;
+				break;
+			}
+			continue;
+		}
+
+		if (end - p < (int)(2 * sizeof(guint32)))
+			break;
+		posting.id = read_u32(p);
+		posting.pos = read_u32(p + sizeof(guint32));
+		p += 2 * sizeof(guint32);
+		add_posting(term, &posting);
+	}
+
+out:
+	g_free(header);
+	g_free(contents);
+	return ok;
+}
+
+gboolean
+text_index_load(const char *stamp)
+{
+	char *filename, *contents, *p, *end;
+	gsize length;
+	gboolean ok = FALSE, sorted;
+
+	filename = g_build_filename(purple_user_dir(), TERMS_FILE, NULL);
+	if (!g_file_get_contents(filename, &contents, &length, NULL)) {
+		g_free(filename);
+		return FALSE;
+	}
+	g_free(filename);
+
+	end = contents + length;
+
+	if (length < strlen(TERMS_VERSION " ") ||
+			strncmp(contents, TERMS_VERSION " ", strlen(TERMS_VERSION " ")) ||
+			(p = memchr(contents, '\n', length)) == NULL) {
+		tl_debug("ignoring a text index of an unknown version\n");
+		goto out;
+	}
+	base_stamp = g_strndup(contents + strlen(TERMS_VERSION " "),
+			p - contents - strlen(TERMS_VERSION " "));
+	base_length = length;
+
+	for (p++; p < end; ) {
+		char *term = p;
+		GArray *postings;
+		guint32 n, i;
+
+		p = memchr(p, '\0', end - p);
+		if (p == NULL || end - ++p < (int)sizeof(guint32))
+			goto out;
+
+		n = read_u32(p);
+		p += sizeof(guint32);
+		if ((gsize)(end - p) / (2 * sizeof(guint32)) < n)
+			goto out;
+
+		postings = g_array_sized_new(FALSE, FALSE, sizeof(posting_t), n);
+		sorted = TRUE;
+		for (i = 0; i < n; i++) {
+			posting_t posting;
+
+			posting.id = read_u32(p);
+			posting.pos = read_u32(p + sizeof(guint32));
+			p += 2 * sizeof(guint32);
+			g_array_append_val(postings, posting);
+
+			if (i > 0 && posting_compare(&g_array_index(postings, posting_t, i - 1),
+						&posting) > 0)
+				sorted = FALSE;
+		}
+		/* saved before the places were kept in order */
+		if (!sorted)
+			g_array_sort(postings, posting_compare);
+		g_hash_table_replace(terms, g_strdup(term), postings);
+	}
+
+	ok = !strcmp(base_stamp, stamp) || load_added(stamp);
+	if (ok) {
+		tl_debug("loaded %u words from the text index\n", g_hash_table_size(terms));
+	} else {
+		tl_debug("the text index is out of date\n");
+	}
+
+out:
+	if (!ok)
+		text_index_clear();
+	g_free(contents);
+	return ok;
+}
+
+/* Searching */
+
+static void
+collect_term(const char *term, gpointer data)
+{
+	g_ptr_array_add(data, g_strdup(term));
+}
+
+/* Splits a query into its phrases: each word is one, but the words in
+ * "quotes" make one together. */
+static GPtrArray *
+parse_query(const char *query)
+{
+	GPtrArray *phrases = g_ptr_array_new(), *words = g_ptr_array_new();
+	char **parts;
+	guint i, j;
+
+	/* every other part is quoted */
+	parts = g_strsplit(query, "\"", -1);
+
+	for (i = 0; parts[i] != NULL; i++) {
+		tokenize(parts[i], collect_term, words);
+
+		if (i % 2 == 1 && words->len > 0) {
+			g_ptr_array_add(phrases, words);
+			words = g_ptr_array_new();
+			continue;
+		}
+
+		for (j = 0; j < words->len; j++) {
+			GPtrArray *word = g_ptr_array_new();
+
+			g_ptr_array_add(word, g_ptr_array_index(words, j));
+			g_ptr_array_add(phrases, word);
+		}
+		g_ptr_array_set_size(words, 0);
+	}
+
+	g_strfreev(parts);
+	g_ptr_array_free(words, TRUE);
+
+	return phrases;
+}
+
+static void
+free_words(GPtrArray *words)
+{
+	guint i;
+
+	for (i = 0; i < words->len; i++)
+		g_free(g_ptr_array_index(words, i));
+	g_ptr_array_free(words, TRUE);
+}
+
+static void
+free_query(GPtrArray *phrases)
+{
+	guint i;
+
+	for (i = 0; i < phrases->len; i++)
+		free_words(g_ptr_array_index(phrases, i));
+	g_ptr_array_free(phrases, TRUE);
+}
+
+typedef struct {
+	const char *prefix;
+	GPtrArray *lists;
+} prefix_state_t;
+
+static void
+collect_prefix(gpointer key, gpointer value, gpointer data)
+{
+	prefix_state_t *state = data;
+
+	if (g_str_has_prefix(key, state->prefix))
+		g_ptr_array_add(state->lists, value);
+}
+
+/* The places of every word that starts with prefix, sorted, or NULL if
+ * there are none.  If that is more than one word, their lists are merged
+ * into a new one and *merged is set. */
+static GArray *
+prefix_postings(const char *prefix, gboolean *merged)
+{
+	prefix_state_t state;
+	GArray *postings = NULL, *list;
+	guint i;
+
+	state.prefix = prefix;
+	state.lists = g_ptr_array_new();
+	g_hash_table_foreach(terms, collect_prefix, &state);
+
+	*merged = state.lists->len > 1;
+	if (state.lists->len == 1) {
+		postings = g_ptr_array_index(state.lists, 0);
+	} else if (*merged) {
+		postings = g_array_new(FALSE, FALSE, sizeof(posting_t));
+		for (i = 0; i < state.lists->len; i++) {
+			list = g_ptr_array_index(state.lists, i);
+			g_array_append_vals(postings, list->data, list->len);
+		}
+		g_array_sort(postings, posting_compare);
+	}
+
+	g_ptr_array_free(state.lists, TRUE);
+	return postings;
+}
+
+/* Counts the occurrences of a phrase (or of a single word) in each log,
+ * as log id -> count.  With prefix, its last word only has to start the
+ * word in the log. */
+static GHashTable *
+match_phrase(GPtrArray *phrase, gboolean prefix)
+{
+	GHashTable *counts = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GArray **lists;
+	gboolean merged = FALSE;
+	guint i, k, last = phrase->len - 1;
+
+	lists = g_new0(GArray *, phrase->len);
+	for (k = 0; k < phrase->len; k++) {
+		if (prefix && k == last)
+			lists[k] = prefix_postings(g_ptr_array_index(phrase, k), &merged);
+		else
+			lists[k] = g_hash_table_lookup(terms, g_ptr_array_index(phrase, k));
+		if (lists[k] == NULL)
+			goto out;
+	}
+
+	for (i = 0; i < lists[0]->len; i++) {
+		posting_t *first = &g_array_index(lists[0], posting_t, i);
+		gpointer id = GUINT_TO_POINTER(first->id);
+
+		/* the rest of the words must follow this one in the same log */
+		for (k = 1; k < phrase->len; k++) {
+			posting_t want;
+
+			want.id = first->id;
+			want.pos = first->pos + k;
+			if (!bsearch(&want, lists[k]->data, lists[k]->len, sizeof(posting_t),
+						(int (*)(const void *, const void *))posting_compare))
+				break;
+		}
+
+		if (k == phrase->len)
+			g_hash_table_insert(counts, id,
+					GINT_TO_POINTER(GPOINTER_TO_INT(g_hash_table_lookup(counts, id)) + 1));
+	}
+
+out:
+	if (merged && lists[last] != NULL)
+		g_array_free(lists[last], TRUE);
+	g_free(lists);
+
+	return counts;
+}
+
+typedef struct {
+	GHashTable *scores;		/* log id -> gdouble *, NULL before the first phrase */
+	GHashTable *counts;		/* of the current phrase */
+	double idf;
+} score_state_t;
+
+static gboolean
+drop_unmatched(gpointer key, gpointer value, gpointer data)
+{
+	score_state_t *state = data;
+	gpointer count = g_hash_table_lookup(state->counts, key);
+
+	if (count == NULL)
+		return TRUE;
+
+	*(gdouble *)value += GPOINTER_TO_INT(count) * state->idf;
+	return FALSE;
+}
+
+static void
+add_score(gpointer key, gpointer value, gpointer data)
+{
+	score_state_t *state = data;
+	gdouble *score = g_new(gdouble, 1);
+
+	*score = GPOINTER_TO_INT(value) * state->idf;
+	g_hash_table_insert(state->scores, key, score);
+}
+
+/* Every log that has each phrase in it counts towards the logs' scores */
+static void
+score_phrase(score_state_t *state, GPtrArray *phrase, gboolean prefix, guint n_logs)
+{
+	gboolean first = state->scores == NULL;
+
+	state->counts = match_phrase(phrase, prefix);
+	/* rare phrases say more about a log than common ones */
+	state->idf = log((n_logs + 1.0) / (g_hash_table_size(state->counts) + 1.0)) + 1.0;
+
+	if (first) {
+		state->scores = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+		g_hash_table_foreach(state->counts, add_score, state);
+	} else {
+		g_hash_table_foreach_remove(state->scores, drop_unmatched, state);
+	}
+
+	g_hash_table_destroy(state->counts);
+	state->counts = NULL;
+}
+
+/* Finds the logs that have every word of the query in them, with the words
+ * in "quotes" next to each other.  The last word of the query matches the
+ * words it starts, as it may not have been typed out.  Returns them as log
+ * id -> a gdouble score that is higher for better matches, or NULL if the
+ * query has no words. */
+GHashTable *
+text_index_search(const char *query, guint n_logs)
+{
+	score_state_t state = { NULL, NULL, 0.0 };
+	GPtrArray *phrases = parse_query(query);
+	guint i;
+
+	for (i = 0; i < phrases->len; i++)
+		score_phrase(&state, g_ptr_array_index(phrases, i), i == phrases->len - 1,
+				n_logs);
+
+	free_query(phrases);
+
+	return state.scores;
+}
+
+/* Whether text has the query in it, the way text_index_search() would find
+ * it if text were a log in the index.  It touches nothing else, so it can
+ * be called from any thread. */
+gboolean
+text_index_match(const char *text, const char *query)
+{
+	GPtrArray *phrases = parse_query(query), *words = g_ptr_array_new();
+	gboolean found = phrases->len > 0;
+	guint i, j, k;
+
+	tokenize(text, collect_term, words);
+
+	for (i = 0; found && i < phrases->len; i++) {
+		GPtrArray *phrase = g_ptr_array_index(phrases, i);
+		gboolean prefix = i == phrases->len - 1;
+
+		found = FALSE;
+		for (j = 0; !found && j + phrase->len <= words->len; j++) {
+			for (k = 0; k < phrase->len; k++) {
+				const char *want = g_ptr_array_index(phrase, k);
+				const char *word = g_ptr_array_index(words, j + k);
+
+				if (prefix && k == phrase->len - 1 ?
+						!g_str_has_prefix(word, want) : strcmp(word, want))
+					break;
+			}
+			found = k == phrase->len;
+		}
+	}
+
+	free_words(words);
+	free_query(phrases);
+
+	return found;
+}
@@ -0,0 +1,35 @@
+/*
+ * TimeLog plugin.
+ *
+ * Copyright (C) 2006 Jon Oberheide.
+ * Copyright (C) 2007-2008 Stu Tomlinson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _TEXT_INDEX_H_
+#define _TEXT_INDEX_H_
+
+void text_index_init(void);
+void text_index_uninit(void);
+void text_index_clear(void);
+gboolean text_index_load(const char *stamp);
+void text_index_save(const char *stamp);
+int text_index_add(guint id, int pos, const char *text);
+GHashTable *text_index_search(const char *query, guint n_logs);
+gboolean text_index_match(const char *text, const char *query);
+
+#endif
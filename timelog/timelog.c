@@ -38,74 +38,36 @@
 #include <gtkplugin.h>
 
 #include "timelog.h"
+#include "log-index.h"
 #include "log-widget.h"
 #include "range-widget.h"
 
-typedef struct {
-	PurpleAccount *account;
-	GList *logs;
-	time_t start;
-	time_t end;
-} log_query_t;
-
-static void
-foreach_log(gpointer value, gpointer data)
-{
-	PurpleLog *log = (PurpleLog *) value;
-	log_query_t *query = (log_query_t *) data;
-
-	if (log->time >= query->start && log->time <= query->end) {
-		query->logs = g_list_append(query->logs, log);
-	}
-}
-
-static void
-foreach_log_set(gpointer key, gpointer value, gpointer data)
-{
-	GList *logs;
-	PurpleLogSet *set = (PurpleLogSet *) value;
-	log_query_t *query = (log_query_t *) data;
-
-	if (query->account != set->account) {
-		return;
-	}
-
-	logs = purple_log_get_logs(set->type, set->name, set->account);
-
-	g_list_foreach(logs, foreach_log, query);
-}
-
 static void
 cb_select_time(gpointer data, PurpleRequestFields *fields)
 {
-	GHashTable *log_sets;
 	GtkWidget *range_dialog;
-	log_query_t *query;
+	PurpleAccount *account;
+	GList *logs;
+	time_t start, end;
 
-	query = g_new0(log_query_t, 1);
-	query->account = purple_request_fields_get_account(fields, "acct");
+	account = purple_request_fields_get_account(fields, "acct");
 
 	range_dialog = range_widget_create();
 
 	if (gtk_dialog_run(GTK_DIALOG(range_dialog)) == GTK_RESPONSE_OK) {
-		range_widget_get_bounds(range_dialog, &query->start, &query->end);
+		range_widget_get_bounds(range_dialog, &start, &end);
 
-		log_sets = purple_log_get_log_sets();
-		g_hash_table_foreach(log_sets, foreach_log_set, query);
+		logs = log_index_query(account, start, end);
 
 		tl_debug("found %u logs for %s between %lu and %lu\n", 
-				g_list_length(query->logs),
-				query->account->username,
-				query->start, query->end);
-
-		log_widget_display_logs(query->logs);
+				g_list_length(logs),
+				account->username,
+				start, end);
 
-		g_hash_table_destroy(log_sets);
+		log_widget_display_logs(logs);
 	}
 
 	range_widget_destroy(range_dialog);
-
-	g_free(query);
 }
 
 static void
@@ -130,6 +92,12 @@ cb_select_account(PurplePluginAction *action)
 			_("Cancel"), NULL, NULL, NULL, NULL, NULL);
 }
 
+static void
+cb_rebuild_index(PurplePluginAction *action)
+{
+	log_index_rebuild();
+}
+
 static GList *
 actions(PurplePlugin *plugin, gpointer context)
 {
@@ -139,18 +107,23 @@ actions(PurplePlugin *plugin, gpointer context)
 	act = purple_plugin_action_new(_("Select Account/Time"), cb_select_account);
 	l = g_list_append(l, act);
 
+	act = purple_plugin_action_new(_("Rebuild Log Index"), cb_rebuild_index);
+	l = g_list_append(l, act);
+
 	return l;
 }
 
 static gboolean
 load_plugin(PurplePlugin *plugin)
 {
+	log_index_init(plugin);
 	return TRUE;
 }
 
 static gboolean
 unload_plugin(PurplePlugin *plugin)
 {
+	log_index_uninit();
 	return TRUE;
 }
 
@@ -0,0 +1,159 @@
+/*
+ * Purple-XChat - Use XChat-like chats
+ * Copyright (C) 2005-2008
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ */
+
+/*
+ * Times markup_to_xtext() against purple_markup_strip_html(), which is
+ * what the chats used before, over a corpus of messages.
+ *
+ *     make bench-markup
+ *     ./bench-markup [-n rounds] [log.html ...]
+ *
+ * Every line of the given files is one message, so Pidgin's HTML chat
+ * logs make a real corpus.  With no files a synthetic one is used.
+ */
+
+/* If you can't figure out what this line is for, DON'T TOUCH IT. */
+#include "../common/pp_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <util.h>
+
+#include "markup.h"
+
+typedef char *(*convert_func)(const char *html);
+
+static GPtrArray *
+synthetic_corpus(void)
+{
+	static const char *messages[] = {
+		"hello there",
+		"<b>bold</b> and <i>italic</i> and <u>underlined</u>",
+		"<font color=\"#A82F2F\"><font size=\"2\">(12:34:56)</font> <b>nick:</b></font> message",
+		"see <a href=\"http://pidgin.im/\">http://pidgin.im/</a> &amp; "
+			"<a href=\"http://example.com/a?b=c&amp;d=e\">this page</a>",
+		"<span style=\"font-family: sans\"><font face=\"Verdana\" size=\"3\">"
+			"a longer message with some more text in it, the way people type "
+			"when they have a lot to say &lt;3</font></span>",
+		"line one<br>line two<br/>line three",
+		"<p>a paragraph</p><div>and a div</div><ul><li>one<li>two</ul>",
+		"<!-- a comment -->&quot;quoted&quot; &#169; &eacute;t&eacute;",
+	};
+	GPtrArray *corpus = g_ptr_array_new();
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		g_ptr_array_add(corpus, g_strdup(messages[i % G_N_ELEMENTS(messages)]));
+
+	return corpus;
+}
+
+static gboolean
+load_corpus(GPtrArray *corpus, const char *filename)
+{
+	char *contents, **lines;
+	int i;
+
+	if (!g_file_get_contents(filename, &contents, NULL, NULL))
+	{
+		fprintf(stderr, "can't read %s\n", filename);
+		return FALSE;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++)
+	{
+		if (*lines[i])
+			g_ptr_array_add(corpus, lines[i]);
+		else
+			g_free(lines[i]);
+	}
+	g_free(lines);
+	g_free(contents);
+
+	return TRUE;
+}
+
+static void
+run(const char *label, convert_func convert, GPtrArray *corpus, gsize bytes, int rounds)
+{
+	GTimer *timer = g_timer_new();
+	double elapsed;
+	guint i;
+	int r;
+
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < corpus->len; i++)
+			g_free(convert(g_ptr_array_index(corpus, i)));
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	printf("%-26s %8.3f s %12.0f msgs/s %8.1f MB/s\n", label, elapsed,
+			corpus->len * (double)rounds / elapsed,
+			bytes * (double)rounds / elapsed / (1024 * 1024));
+}
+
+int
+main(int argc, char *argv[])
+{
+	GPtrArray *corpus;
+	gsize bytes = 0;
+	int rounds = 100, i = 1;
+	guint j;
+
+	if (argc > 2 && !strcmp(argv[1], "-n"))
+	{
+		rounds = MAX(atoi(argv[2]), 1);
+		i = 3;
+	}
+
+	if (i < argc)
+	{
+		corpus = g_ptr_array_new();
+		for (; i < argc; i++)
+			if (!load_corpus(corpus, argv[i]))
+				return 1;
+	}
+	else
+		corpus = synthetic_corpus();
+
+	if (corpus->len == 0)
+	{
+		fprintf(stderr, "no messages\n");
+		return 1;
+	}
+
+	for (j = 0; j < corpus->len; j++)
+		bytes += strlen(g_ptr_array_index(corpus, j));
+	printf("%u messages, %lu bytes, %d rounds\n", corpus->len, (unsigned long)bytes, rounds);
+
+	run("purple_markup_strip_html", purple_markup_strip_html, corpus, bytes, rounds);
+	run("markup_to_xtext", markup_to_xtext, corpus, bytes, rounds);
+
+	for (j = 0; j < corpus->len; j++)
+		g_free(g_ptr_array_index(corpus, j));
+	g_ptr_array_free(corpus, TRUE);
+
+	return 0;
+}
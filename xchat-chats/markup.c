@@ -0,0 +1,209 @@
+/*
+ * Purple-XChat - Use XChat-like chats
+ * Copyright (C) 2005-2008
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ */
+
+/* If you can't figure out what this line is for, DON'T TOUCH IT. */
+#include "../common/pp_internal.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include <util.h>
+
+#include "xtext.h"
+#include "markup.h"
+
+#define TAG_IS(s) (len == sizeof(s) - 1 && !g_ascii_strncasecmp(name, s, len))
+
+/* Find attr="value" inside the tag running from tag to end. */
+static gboolean
+tag_attr(const char *tag, const char *end, const char *attr, const char **value, int *len)
+{
+	int alen = strlen(attr);
+	const char *p, *v;
+	char quote;
+
+	for (p = tag; p + alen < end; p++)
+	{
+		if (!g_ascii_isspace(p[-1]) || g_ascii_strncasecmp(p, attr, alen) || p[alen] != '=')
+			continue;
+
+		v = p + alen + 1;
+		if (*v == '"' || *v == '\'')
+		{
+			quote = *v++;
+			for (p = v; p < end && *p != quote; p++)
+				;
+		}
+		else
+		{
+			for (p = v; p < end && !g_ascii_isspace(*p); p++)
+				;
+		}
+		*value = v;
+		*len = p - v;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* The codes toggle, so only the outermost of nested tags may emit one. */
+static void
+nest_attr(GString *out, int *depth, gboolean closing, char attr)
+{
+	if (!closing && (*depth)++ == 0)
+		g_string_append_c(out, attr);
+	else if (closing && *depth > 0 && --(*depth) == 0)
+		g_string_append_c(out, attr);
+}
+
+/* Where the text goes on after a <script> or <style>: past its closing
+ * tag, or at the end if there is none. */
+static const char *
+skip_cdata(const char *p, const char *close)
+{
+	const char *end = purple_strcasestr(p, close);
+
+	if (end == NULL || (end = strchr(end, '>')) == NULL)
+		return p + strlen(p);
+	return end + 1;
+}
+
+/* Turns libpurple's HTML into text with xtext attribute codes in a single
+ * pass: <b>, <i> and <u> become the matching codes, <a href> is written
+ * the way purple_markup_strip_html() writes it, and entities are decoded.
+ * Like purple_markup_strip_html(), block tags become line breaks and
+ * <script> and <style> are dropped with their contents.  Colours are
+ * dropped too: the chat colours each message by who it's from. */
+char *
+markup_to_xtext(const char *html)
+{
+	GString *out;
+	const char *p, *end, *name, *entity;
+	const char *href = NULL;
+	int href_len = 0;
+	gsize link_start = 0;
+	int bold = 0, italics = 0, underline = 0;
+	int len, closing;
+
+	g_return_val_if_fail(html != NULL, NULL);
+
+	out = g_string_sized_new(strlen(html));
+
+	for (p = html; *p; )
+	{
+		if (*p == '&')
+		{
+			entity = purple_markup_unescape_entity(p, &len);
+			if (entity)
+			{
+				g_string_append(out, entity);
+				p += len;
+			}
+			else
+				g_string_append_c(out, *p++);
+			continue;
+		}
+
+		if (*p != '<')
+		{
+			len = strcspn(p, "<&");
+			g_string_append_len(out, p, len);
+			p += len;
+			continue;
+		}
+
+		if (!strncmp(p, "<!--", 4) && (end = strstr(p, "-->")) != NULL)
+		{
+			p = end + 3;
+			continue;
+		}
+
+		end = strchr(p, '>');
+		if (end == NULL)
+		{
+			g_string_append(out, p);	/* not a tag after all */
+			break;
+		}
+
+		closing = (p[1] == '/');
+		name = p + 1 + closing;
+		for (len = 0; g_ascii_isalnum(name[len]); len++)
+			;
+
+		if (TAG_IS("b") || TAG_IS("strong"))
+			nest_attr(out, &bold, closing, ATTR_BOLD);
+		else if (TAG_IS("i") || TAG_IS("em"))
+			nest_attr(out, &italics, closing, ATTR_ITALICS);
+		else if (TAG_IS("u"))
+			nest_attr(out, &underline, closing, ATTR_UNDERLINE);
+		else if (TAG_IS("a"))
+		{
+			if (!closing && tag_attr(name + len, end, "href", &href, &href_len))
+			{
+				link_start = out->len;
+			}
+			else if (closing && href)
+			{
+				char *url = g_strndup(href, href_len);
+				char *unescaped = purple_unescape_html(url);
+				gsize ulen = strlen(unescaped);
+				gsize tlen = out->len - link_start;
+				const char *text = out->str + link_start;
+
+				/* only add the address if it isn't already the text */
+				if ((ulen != tlen || strncmp(text, unescaped, ulen)) &&
+					(ulen != tlen + 7 || strncmp(text, unescaped + 7, tlen)))
+					g_string_append_printf(out, " (%s)", unescaped);
+				g_free(unescaped);
+				g_free(url);
+				href = NULL;
+			}
+		}
+		else if (TAG_IS("br"))
+			g_string_append_c(out, '\n');
+		else if (!closing && (TAG_IS("p") || TAG_IS("tr") || TAG_IS("hr") ||
+					TAG_IS("li") || TAG_IS("div")))
+		{
+			/* but not twice in a row */
+			if (out->len > 0 && out->str[out->len - 1] != '\n')
+				g_string_append_c(out, '\n');
+		}
+		else if (!closing && TAG_IS("td"))
+		{
+			if (out->len > 0 && out->str[out->len - 1] != '\n')
+				g_string_append_c(out, '\t');
+		}
+		else if (!closing && TAG_IS("script"))
+		{
+			p = skip_cdata(end + 1, "</script");
+			continue;
+		}
+		else if (!closing && TAG_IS("style"))
+		{
+			p = skip_cdata(end + 1, "</style");
+			continue;
+		}
+
+		p = end + 1;
+	}
+
+	return g_string_free(out, FALSE);
+}
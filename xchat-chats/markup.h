@@ -0,0 +1,7 @@
+#ifndef __MARKUP_H__
+#define __MARKUP_H__
+
+/* libpurple's HTML as text with xtext attribute codes, g_free() it */
+char *markup_to_xtext(const char *html);
+
+#endif
@@ -0,0 +1,298 @@
+/* X-Chat
+ * Copyright (C) 1998 Peter Zelezny.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301, USA
+ * =========================================================================
+ *
+ * SSE2 and NEON versions of xtext's shade_ximage_15/16/32.
+ *
+ * Every channel of every pixel becomes
+ *
+ *     (m * c + (256 - m) * bg_c) >> 8
+ *
+ * with m <= 256 and c, bg_c <= 255, so the sum never exceeds 16 bits and
+ * the whole thing can be done in 16-bit lanes with the same rounding as
+ * the plain C code: the output is bit for bit identical.
+ */
+
+#include <glib.h>
+
+#include "simd_cmod.h"
+
+/* the vector code assumes the byte order of 32-bit pixels in memory */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SSE2
+#define SSE2_FUNC
+#define have_sse2() TRUE
+#elif defined(__i386__) && defined(__GNUC__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SSE2
+#define SSE2_FUNC __attribute__ ((target ("sse2")))
+#define have_sse2() __builtin_cpu_supports ("sse2")
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define USE_NEON
+#endif
+#endif
+
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef USE_NEON
+#include <arm_neon.h>
+#endif
+
+typedef struct
+{
+	int shift[3];		/* red, green, blue bitfields */
+	int mask[3];
+	int mul[3];			/* rm, gm, bm */
+	int add[3];			/* (256 - m) * background channel */
+} shade_params;
+
+typedef void (*shade_row_func) (void *row, int w, const shade_params *sp);
+
+static guint32
+shade_pixel (const shade_params *sp, guint32 p)
+{
+	guint32 out = 0;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		out |= ((((p >> sp->shift[i]) & sp->mask[i]) * sp->mul[i] + sp->add[i])
+				  >> 8) << sp->shift[i];
+
+	return out;
+}
+
+#ifdef USE_SSE2
+
+SSE2_FUNC static void
+shade_row_16_sse2 (void *row, int w, const shade_params *sp)
+{
+	guint16 *p = row;
+	__m128i shift[3], mask[3], mul[3], add[3];
+	__m128i v, c, out;
+	int x, i;
+
+	for (i = 0; i < 3; i++)
+	{
+		shift[i] = _mm_cvtsi32_si128 (sp->shift[i]);
+		mask[i] = _mm_set1_epi16 (sp->mask[i]);
+		mul[i] = _mm_set1_epi16 (sp->mul[i]);
+		add[i] = _mm_set1_epi16 (sp->add[i]);
+	}
+
+	for (x = 0; x + 8 <= w; x += 8)
+	{
+		v = _mm_loadu_si128 ((__m128i *) (p + x));
+		out = _mm_setzero_si128 ();
+		for (i = 0; i < 3; i++)
+		{
+			c = _mm_and_si128 (_mm_srl_epi16 (v, shift[i]), mask[i]);
+			c = _mm_add_epi16 (_mm_mullo_epi16 (c, mul[i]), add[i]);
+			out = _mm_or_si128 (out, _mm_sll_epi16 (_mm_srli_epi16 (c, 8), shift[i]));
+		}
+		_mm_storeu_si128 ((__m128i *) (p + x), out);
+	}
+
+	for (; x < w; x++)
+		p[x] = shade_pixel (sp, p[x]);
+}
+
+SSE2_FUNC static void
+shade_row_32_sse2 (void *row, int w, const shade_params *sp)
+{
+	guint32 *p = row;
+	__m128i zero, mul, add, v, lo, hi;
+	int x;
+
+	/* 16-bit lanes are B, G, R, pad for each pixel */
+	zero = _mm_setzero_si128 ();
+	mul = _mm_set_epi16 (0, sp->mul[0], sp->mul[1], sp->mul[2],
+								0, sp->mul[0], sp->mul[1], sp->mul[2]);
+	add = _mm_set_epi16 (0, sp->add[0], sp->add[1], sp->add[2],
+								0, sp->add[0], sp->add[1], sp->add[2]);
+
+	for (x = 0; x + 4 <= w; x += 4)
+	{
+		v = _mm_loadu_si128 ((__m128i *) (p + x));
+		lo = _mm_unpacklo_epi8 (v, zero);
+		hi = _mm_unpackhi_epi8 (v, zero);
+		lo = _mm_srli_epi16 (_mm_add_epi16 (_mm_mullo_epi16 (lo, mul), add), 8);
+		hi = _mm_srli_epi16 (_mm_add_epi16 (_mm_mullo_epi16 (hi, mul), add), 8);
+		_mm_storeu_si128 ((__m128i *) (p + x), _mm_packus_epi16 (lo, hi));
+	}
+
+	for (; x < w; x++)
+		p[x] = shade_pixel (sp, p[x]);
+}
+
+#endif /* USE_SSE2 */
+
+#ifdef USE_NEON
+
+static void
+shade_row_16_neon (void *row, int w, const shade_params *sp)
+{
+	guint16 *p = row;
+	int16x8_t rshift[3], lshift[3];
+	uint16x8_t mask[3], mul[3], add[3];
+	uint16x8_t v, c, out;
+	int x, i;
+
+	for (i = 0; i < 3; i++)
+	{
+		rshift[i] = vdupq_n_s16 (-sp->shift[i]);
+		lshift[i] = vdupq_n_s16 (sp->shift[i]);
+		mask[i] = vdupq_n_u16 (sp->mask[i]);
+		mul[i] = vdupq_n_u16 (sp->mul[i]);
+		add[i] = vdupq_n_u16 (sp->add[i]);
+	}
+
+	for (x = 0; x + 8 <= w; x += 8)
+	{
+		v = vld1q_u16 (p + x);
+		out = vdupq_n_u16 (0);
+		for (i = 0; i < 3; i++)
+		{
+			c = vandq_u16 (vshlq_u16 (v, rshift[i]), mask[i]);
+			c = vmlaq_u16 (add[i], c, mul[i]);
+			out = vorrq_u16 (out, vshlq_u16 (vshrq_n_u16 (c, 8), lshift[i]));
+		}
+		vst1q_u16 (p + x, out);
+	}
+
+	for (; x < w; x++)
+		p[x] = shade_pixel (sp, p[x]);
+}
+
+static void
+shade_row_32_neon (void *row, int w, const shade_params *sp)
+{
+	guint32 *p = row;
+	guint16 m[8], a[8];
+	uint16x8_t mul, add, lo, hi;
+	uint8x16_t v;
+	int x, i;
+
+	/* 16-bit lanes are B, G, R, pad for each pixel */
+	for (i = 0; i < 8; i += 4)
+	{
+		m[i] = sp->mul[2];
+		m[i + 1] = sp->mul[1];
+		m[i + 2] = sp->mul[0];
+		m[i + 3] = 0;
+		a[i] = sp->add[2];
+		a[i + 1] = sp->add[1];
+		a[i + 2] = sp->add[0];
+		a[i + 3] = 0;
+	}
+	mul = vld1q_u16 (m);
+	add = vld1q_u16 (a);
+
+	for (x = 0; x + 4 <= w; x += 4)
+	{
+		v = vld1q_u8 ((guint8 *) (p + x));
+		lo = vshrq_n_u16 (vmlaq_u16 (add, vmovl_u8 (vget_low_u8 (v)), mul), 8);
+		hi = vshrq_n_u16 (vmlaq_u16 (add, vmovl_u8 (vget_high_u8 (v)), mul), 8);
+		vst1q_u8 ((guint8 *) (p + x), vcombine_u8 (vmovn_u16 (lo), vmovn_u16 (hi)));
+	}
+
+	for (; x < w; x++)
+		p[x] = shade_pixel (sp, p[x]);
+}
+
+#endif /* USE_NEON */
+
+static shade_row_func shade_row_16;
+static shade_row_func shade_row_32;
+
+/* pick the routines for this CPU, once */
+
+static void
+shade_simd_init (void)
+{
+	static gboolean done = FALSE;
+
+	if (done)
+		return;
+	done = TRUE;
+
+#ifdef USE_SSE2
+	if (have_sse2 ())
+	{
+		shade_row_16 = shade_row_16_sse2;
+		shade_row_32 = shade_row_32_sse2;
+	}
+#endif
+#ifdef USE_NEON
+	shade_row_16 = shade_row_16_neon;
+	shade_row_32 = shade_row_32_neon;
+#endif
+}
+
+int
+shade_image_simd (void *data, int bpl, int bpp, int depth, int w, int h,
+						int rm, int gm, int bm, int bg)
+{
+	shade_params sp;
+	shade_row_func row;
+	int i;
+
+	shade_simd_init ();
+
+	/* outside this range the sums don't fit in 16 bits */
+	if (rm < 0 || rm > 256 || gm < 0 || gm > 256 || bm < 0 || bm > 256)
+		return FALSE;
+
+	switch (depth)
+	{
+	case 15:
+		sp.shift[0] = 10; sp.shift[1] = 5; sp.shift[2] = 0;
+		sp.mask[0] = 0x1f; sp.mask[1] = 0x1f; sp.mask[2] = 0x1f;
+		row = shade_row_16;
+		break;
+	case 16:
+		sp.shift[0] = 11; sp.shift[1] = 5; sp.shift[2] = 0;
+		sp.mask[0] = 0x1f; sp.mask[1] = 0x3f; sp.mask[2] = 0x1f;
+		row = shade_row_16;
+		break;
+	case 24:
+		if (bpp != 32)
+			return FALSE;	/* packed 24-bit stays in plain C */
+	case 32:
+		sp.shift[0] = 16; sp.shift[1] = 8; sp.shift[2] = 0;
+		sp.mask[0] = 0xff; sp.mask[1] = 0xff; sp.mask[2] = 0xff;
+		row = shade_row_32;
+		break;
+	default:
+		return FALSE;
+	}
+
+	if (!row)
+		return FALSE;
+
+	sp.mul[0] = rm;
+	sp.mul[1] = gm;
+	sp.mul[2] = bm;
+	for (i = 0; i < 3; i++)
+		sp.add[i] = (256 - sp.mul[i]) * ((bg >> sp.shift[i]) & sp.mask[i]);
+
+	for (i = 0; i < h; i++)
+		row ((unsigned char *) data + i * bpl, w, &sp);
+
+	return TRUE;
+}
@@ -0,0 +1,11 @@
+#ifndef __SIMD_CMOD_H__
+#define __SIMD_CMOD_H__
+
+/* Tint an XImage in place with SSE2 or NEON, whichever this CPU has.
+ * Gives exactly the same result as the plain C shade_ximage_* routines.
+ * Returns FALSE (and does nothing) if no vector routine fits the
+ * depth/bpp, so the caller should fall back to those. */
+int shade_image_simd (void *data, int bpl, int bpp, int depth, int w, int h,
+							 int rm, int gm, int bm, int bg);
+
+#endif
@@ -0,0 +1,159 @@
+/* X-Chat
+ * Copyright (C) 1998 Peter Zelezny.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301, USA
+ * =========================================================================
+ *
+ * Shades random images with shade_image_simd() and with the plain C
+ * routines from xtext.c, and checks that every pixel comes out the same.
+ * Exits with 77 (skipped) on CPUs without SSE2 or NEON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "simd_cmod.h"
+
+#define ROUNDS 2000
+
+/* xtext.c's SHADE_IMAGE and the routines built from it, as they are there */
+
+#define SHADE_IMAGE(bytes, type, rmask, gmask, bmask) \
+	unsigned char *ptr; \
+	int x, y; \
+	int bgr = (256 - rm) * (bg & rmask); \
+	int bgg = (256 - gm) * (bg & gmask); \
+	int bgb = (256 - bm) * (bg & bmask); \
+	ptr = (unsigned char *) data + (w * bytes); \
+	for (y = h; --y >= 0;) \
+	{ \
+		for (x = -w; x < 0; x++) \
+		{ \
+			int r, g, b; \
+			b = ((type *) ptr)[x]; \
+			r = rm * (b & rmask) + bgr; \
+			g = gm * (b & gmask) + bgg; \
+			b = bm * (b & bmask) + bgb; \
+			((type *) ptr)[x] = ((r >> 8) & rmask) \
+										| ((g >> 8) & gmask) \
+										| ((b >> 8) & bmask); \
+		} \
+		ptr += bpl; \
+    }
+
+static void
+shade_ximage_15 (void *data, int bpl, int w, int h, int rm, int gm, int bm, int bg)
+{
+	SHADE_IMAGE (2, guint16, 0x7c00, 0x3e0, 0x1f);
+}
+
+static void
+shade_ximage_16 (void *data, int bpl, int w, int h, int rm, int gm, int bm, int bg)
+{
+	SHADE_IMAGE (2, guint16, 0xf800, 0x7e0, 0x1f);
+}
+
+static void
+shade_ximage_32 (void *data, int bpl, int w, int h, int rm, int gm, int bm, int bg)
+{
+	SHADE_IMAGE (4, guint32, 0xff0000, 0xff00, 0xff);
+}
+
+static int
+check (GRand *rand, int depth)
+{
+	int bpp = depth > 16 ? 32 : 16;
+	int w = g_rand_int_range (rand, 1, 100);
+	int h = g_rand_int_range (rand, 1, 8);
+	/* rows are padded, and the padding must be left alone */
+	int bpl = w * bpp / 8 + g_rand_int_range (rand, 0, 3) * 4;
+	int rm = g_rand_int_range (rand, 0, 257);
+	int gm = g_rand_int_range (rand, 0, 257);
+	int bm = g_rand_int_range (rand, 0, 257);
+	int bg = g_rand_int (rand) & (depth > 16 ? 0xffffff : 0xffff);
+	guchar *simd, *plain;
+	int i, ok = TRUE;
+
+	if (depth == 15)
+		bg &= 0x7fff;
+
+	simd = g_malloc (bpl * h);
+	plain = g_malloc (bpl * h);
+	for (i = 0; i < bpl * h; i++)
+		simd[i] = g_rand_int (rand);
+	memcpy (plain, simd, bpl * h);
+
+	if (!shade_image_simd (simd, bpl, bpp, depth, w, h, rm, gm, bm, bg))
+	{
+		printf ("depth %d: no vector routine\n", depth);
+		ok = FALSE;
+	}
+
+	switch (depth)
+	{
+	case 15:
+		shade_ximage_15 (plain, bpl, w, h, rm, gm, bm, bg);
+		break;
+	case 16:
+		shade_ximage_16 (plain, bpl, w, h, rm, gm, bm, bg);
+		break;
+	default:
+		shade_ximage_32 (plain, bpl, w, h, rm, gm, bm, bg);
+		break;
+	}
+
+	if (ok && memcmp (simd, plain, bpl * h) != 0)
+	{
+		printf ("depth %d, %dx%d, bpl %d, masks %d/%d/%d, bg %06x: differs\n",
+				  depth, w, h, bpl, rm, gm, bm, bg);
+		ok = FALSE;
+	}
+
+	g_free (simd);
+	g_free (plain);
+
+	return ok;
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const int depths[] = { 15, 16, 24, 32 };
+	guchar probe[4] = { 0 };
+	GRand *rand;
+	int i, j, failed = 0;
+
+	/* is there a vector routine for this CPU at all? */
+	if (!shade_image_simd (probe, 4, 32, 32, 1, 1, 256, 256, 256, 0))
+	{
+		printf ("no SSE2 or NEON, skipping\n");
+		return 77;
+	}
+
+	rand = argc > 1 ? g_rand_new_with_seed (atoi (argv[1])) : g_rand_new ();
+
+	for (i = 0; i < ROUNDS; i++)
+		for (j = 0; j < (int) G_N_ELEMENTS (depths); j++)
+			if (!check (rand, depths[j]))
+				failed++;
+
+	g_rand_free (rand);
+
+	printf ("%d of %d images differ\n", failed, ROUNDS * (int) G_N_ELEMENTS (depths));
+
+	return failed ? 1 : 0;
+}
@@ -26,21 +26,30 @@
 #define PLUGIN_AUTHOR		"Sadrul Habib Chowdhury <sadrul@users.sourceforge.net>"
 
 #define	PREFS_PREFIX		"/plugins/gtk/" PLUGIN_ID
+#define	PREFS_TIME_STAMP	PREFS_PREFIX "/time_stamp"
 #define	PREFS_DATE_FORMAT	PREFS_PREFIX "/date_format"
+#define	PREFS_SPILL			PREFS_PREFIX "/spill"
+#define	PREFS_SPILL_LINES	PREFS_PREFIX "/spill_lines"
 
 /* System headers */
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <gdk/gdk.h>
 #include <gtk/gtk.h>
 
 /* Purple headers */
 #include <conversation.h>
+#include <debug.h>
+#include <pluginpref.h>
+#include <prefs.h>
 #include <util.h>
 
 /* Pidgin headers */
 #include <gtkconv.h>
 #include <gtkplugin.h>
 
+#include "markup.h"
 #include "xtext.h"
 
 static PurpleConversationUiOps *uiops = NULL;
@@ -154,6 +163,49 @@ is_2_4_0_or_above(void)
 }
 
 
+/* xtext calls this for the timestamp in front of each line */
+int
+xtext_get_stamp_str(time_t tim, char **ret)
+{
+	*ret = g_strdup(purple_utf8_strftime(purple_prefs_get_string(PREFS_DATE_FORMAT),
+				localtime(&tim)));
+	return strlen(*ret);
+}
+
+static void
+set_time_stamp(GtkWidget *xtext)
+{
+	const char *format = purple_prefs_get_string(PREFS_DATE_FORMAT);
+
+	gtk_xtext_set_time_stamp(GTK_XTEXT(xtext)->buffer,
+			purple_prefs_get_bool(PREFS_TIME_STAMP) && format && *format);
+}
+
+/* Keep only the newest lines of a chat in memory and the rest in a
+ * temporary file, if the user wants that. */
+static void
+set_spill(GtkWidget *xtext)
+{
+	char *path = NULL;
+	int fd;
+
+	if (purple_prefs_get_bool(PREFS_SPILL))
+	{
+		fd = g_file_open_tmp("xchat-chats-XXXXXX", &path, NULL);
+		if (fd == -1)
+		{
+			purple_debug_warning(PLUGIN_NAME, "no temporary file for the scrollback\n");
+			return;
+		}
+		close(fd);
+	}
+
+	if (!gtk_xtext_set_spill(GTK_XTEXT(xtext)->buffer, path,
+				purple_prefs_get_int(PREFS_SPILL_LINES)))
+		purple_debug_warning(PLUGIN_NAME, "could not open %s\n", path);
+	g_free(path);
+}
+
 static GtkWidget *get_xtext(PurpleConversation *conv)
 {
 	PurpleXChat *gx;
@@ -190,6 +242,9 @@ static GtkWidget *get_xtext(PurpleConversation *conv)
 					pango_font_description_to_string(style->font_desc)))
 			return NULL;
 
+		set_time_stamp(xtext);
+		set_spill(xtext);
+
 		g_hash_table_insert(xchats, conv, gx);
 	}
 	return gx->xtext;
@@ -219,7 +274,7 @@ static void purple_xchat_write_conv(PurpleConversation *conv, const char *name,
 {
 	PurpleConversationType type;
 	GtkWidget *xtext;
-	char *msg;
+	char *msg, *me;
 	PurpleXChatMessage col = 0;
 
 	/* Do the usual stuff first. */
@@ -237,11 +292,16 @@ static void purple_xchat_write_conv(PurpleConversation *conv, const char *name,
 	xtext = get_xtext(conv);
 	if (name == NULL || !strcmp(name, purple_conversation_get_name(conv)))
 		name = "*";
-	msg = purple_markup_strip_html(message);
-	if (msg && msg[0] == '/' && msg[1] == 'm' && msg[2] == 'e' && msg[3] == ' ')
+	msg = markup_to_xtext(message);
+
+	/* "/me " may come after a bold or the like */
+	for (me = msg; *me == ATTR_BOLD || *me == ATTR_ITALICS || *me == ATTR_UNDERLINE; me++)
+		;
+	if (me[0] == '/' && me[1] == 'm' && me[2] == 'e' && me[3] == ' ')
 	{
 		char *tmp = msg;
-		msg = g_strdup_printf("%s%s", name, tmp+3);
+		memmove(me, me + 3, strlen(me + 3) + 1);
+		msg = g_strdup_printf("%s%s", name, tmp);
 		g_free(tmp);
 		name = "*";
 	}
@@ -362,6 +422,37 @@ purple_xchat_destroy_conv(PurpleConversation *conv)
 	}
 }
 
+static void
+respill(PurpleConversation *conv, PurpleXChat *gx, gpointer null)
+{
+	xtext_buffer *buf = GTK_XTEXT(gx->xtext)->buffer;
+
+	/* a new line count doesn't need a new file */
+	if (buf->spill_fp && purple_prefs_get_bool(PREFS_SPILL))
+		buf->spill_hot = MAX(purple_prefs_get_int(PREFS_SPILL_LINES), 1);
+	else
+		set_spill(gx->xtext);
+}
+
+static void
+restamp(PurpleConversation *conv, PurpleXChat *gx, gpointer null)
+{
+	set_time_stamp(gx->xtext);
+	gtk_widget_queue_draw(gx->xtext);
+}
+
+static void
+date_format_pref_cb(const char *name, PurplePrefType type, gconstpointer val, gpointer null)
+{
+	g_hash_table_foreach(xchats, (GHFunc)restamp, NULL);
+}
+
+static void
+spill_pref_cb(const char *name, PurplePrefType type, gconstpointer val, gpointer null)
+{
+	g_hash_table_foreach(xchats, (GHFunc)respill, NULL);
+}
+
 #if 0
 static void
 workaround_for_hidden_convs(PidginConversation *gtkconv)
@@ -408,6 +499,11 @@ plugin_load(PurplePlugin *plugin)
 		list = list->next;
 	}
 
+	purple_prefs_connect_callback(plugin, PREFS_TIME_STAMP, date_format_pref_cb, NULL);
+	purple_prefs_connect_callback(plugin, PREFS_DATE_FORMAT, date_format_pref_cb, NULL);
+	purple_prefs_connect_callback(plugin, PREFS_SPILL, spill_pref_cb, NULL);
+	purple_prefs_connect_callback(plugin, PREFS_SPILL_LINES, spill_pref_cb, NULL);
+
 #if 0
 	purple_signal_connect(pidgin_conversations_get_handle(), "conversation-displayed",
 			plugin, G_CALLBACK(workaround_for_hidden_convs), NULL);
@@ -447,6 +543,44 @@ plugin_unload(PurplePlugin *plugin)
 	return TRUE;
 }
 
+static PurplePluginPrefFrame *
+get_plugin_pref_frame(PurplePlugin *plugin)
+{
+	PurplePluginPrefFrame *frame;
+	PurplePluginPref *pref;
+
+	frame = purple_plugin_pref_frame_new();
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREFS_TIME_STAMP,
+						_("Show timestamps"));
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREFS_DATE_FORMAT,
+						_("Timestamp format (strftime)"));
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREFS_SPILL,
+						_("Keep older chat lines on disk instead of in memory"));
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREFS_SPILL_LINES,
+						_("Lines to keep in memory"));
+	purple_plugin_pref_set_bounds(pref, 100, 100000);
+	purple_plugin_pref_frame_add(frame, pref);
+
+	return frame;
+}
+
+static PurplePluginUiInfo prefs_info = {
+	get_plugin_pref_frame,
+	0,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
 static PurplePluginInfo info =
 {
 	PURPLE_PLUGIN_MAGIC,		/* Magic				*/
@@ -472,7 +606,7 @@ static PurplePluginInfo info =
 
 	NULL,						/* ui_info				*/
 	NULL,						/* extra_info			*/
-	NULL,						/* prefs_info			*/
+	&prefs_info,				/* prefs_info			*/
 	NULL,						/* actions				*/
 	NULL,						/* reserved 1			*/
 	NULL,						/* reserved 2			*/
@@ -492,7 +626,10 @@ init_plugin(PurplePlugin *plugin) {
 	info.description = _("You can chat in Pidgin using XChat's indented view.");
 
 	purple_prefs_add_none(PREFS_PREFIX);
+	purple_prefs_add_bool(PREFS_TIME_STAMP, FALSE);
 	purple_prefs_add_string(PREFS_DATE_FORMAT, "[%H:%M]");
+	purple_prefs_add_bool(PREFS_SPILL, FALSE);
+	purple_prefs_add_int(PREFS_SPILL_LINES, 2000);
 }
 
 PURPLE_INIT_PLUGIN(PLUGIN_STATIC_NAME, init_plugin, info)
@@ -35,7 +35,9 @@
 
 #define MARGIN 2						/* dont touch. */
 #define REFRESH_TIMEOUT 20
+#define FRAME_INTERVAL 16				/* ms; GTK 2 can't tell us the display's rate */
 #define WORDWRAP_LIMIT 24
+#define REFLOW_CHUNK 250			/* entries rewrapped per idle call */
 
 #include <string.h>
 #include <ctype.h>
@@ -65,6 +67,7 @@
 #include "mmx_cmod.h"
 #endif
 
+#include "simd_cmod.h"
 #include "xtext.h"
 
 #define charlen(str) g_utf8_skip[*(guchar *)(str)]
@@ -93,6 +96,7 @@ struct textentry
 	struct textentry *next;
 	struct textentry *prev;
 	unsigned char *str;
+	unsigned char *fold;	/* casefolded str, or str itself if no different */
 	time_t stamp;
 	gint16 str_width;
 	gint16 str_len;
@@ -101,6 +105,9 @@ struct textentry
 	gint16 indent;
 	gint16 left_len;
 	gint16 lines_taken;
+	int line_slot;		/* position in buf->line_tree */
+	guint wrap_gen;	/* lines_taken is valid if == buf->wrap_gen */
+	struct xtext_spans *spans;	/* clickable words, see gtk_xtext_url_at() */
 	int left_color;
 	int right_color;
 #define RECORD_WRAPS 4
@@ -125,9 +132,7 @@ enum
 
 static guint xtext_signals[LAST_SIGNAL];
 
-#ifdef XCHAT
-int xtext_get_stamp_str (time_t, char **);
-#endif
+static void gtk_xtext_stamp_flush (GtkXText *xtext);
 static void gtk_xtext_render_page (GtkXText * xtext);
 static void gtk_xtext_calc_lines (xtext_buffer *buf, int);
 #if defined(USE_XLIB) || defined(WIN32)
@@ -142,6 +147,9 @@ static int gtk_xtext_render_ents (GtkXText * xtext, textentry *, textentry *);
 static void gtk_xtext_recalc_widths (xtext_buffer *buf, int);
 static void gtk_xtext_fix_indent (xtext_buffer *buf);
 static int gtk_xtext_find_subline (GtkXText *xtext, textentry *ent, int line);
+static void gtk_xtext_search_prune (xtext_buffer *buf);
+static void gtk_xtext_spill_check (xtext_buffer *buf);
+static void gtk_xtext_spill_close (xtext_buffer *buf);
 static char *
 gtk_xtext_strip_color (unsigned char *text, int len, unsigned char *outbuf,
 							  int *newlen, int *mb_ret);
@@ -329,6 +337,15 @@ backend_get_char_width (GtkXText *xtext, unsigned char *str, int *mbl_ret)
 	return ext.xOff;
 }
 
+static int
+backend_measure (GtkXText *xtext, guchar *str, int len)
+{
+	XGlyphInfo ext;
+
+	XftTextExtentsUtf8 (GDK_WINDOW_XDISPLAY (xtext->draw_buf), xtext->font, str, len, &ext);
+	return ext.xOff;
+}
+
 static int
 backend_get_text_width (GtkXText *xtext, guchar *str, int len, int is_mb)
 {
@@ -502,26 +519,27 @@ backend_font_open (GtkXText *xtext, char *name)
 	pango_font_metrics_unref (metrics);
 }
 
+/* ask pango how wide 'str' is, bypassing the width cache */
+
 static int
-backend_get_text_width (GtkXText *xtext, guchar *str, int len, int is_mb)
+backend_measure (GtkXText *xtext, guchar *str, int len)
 {
 	int width;
 
-	if (!is_mb)
-		return gtk_xtext_text_width_8bit (xtext, str, len);
-
-	if (*str == 0)
-		return 0;
-
 	pango_layout_set_text (xtext->layout, (gchar *)str, len);
 	pango_layout_get_pixel_size (xtext->layout, &width, NULL);
 
 	return width;
 }
 
+/* U+0000 to U+00FF come from xtext->fontwidth[], everything else is
+   measured once per font and then kept in xtext->fontwidth_hash */
+
 inline static int
 backend_get_char_width (GtkXText *xtext, unsigned char *str, int *mbl_ret)
 {
+	gpointer cached;
+	gunichar c;
 	int width;
 
 	if (*str < 128)
@@ -531,8 +549,47 @@ backend_get_char_width (GtkXText *xtext, unsigned char *str, int *mbl_ret)
 	}
 
 	*mbl_ret = charlen (str);
-	pango_layout_set_text (xtext->layout, (char *)str, *mbl_ret);
-	pango_layout_get_pixel_size (xtext->layout, &width, NULL);
+	c = g_utf8_get_char_validated ((char *)str, *mbl_ret);
+	if (c == (gunichar)-1 || c == (gunichar)-2)
+		return backend_measure (xtext, str, *mbl_ret);
+	if (c < 256)
+		return xtext->fontwidth[c];
+
+	/* widths are stored + 1, so that a zero width isn't a miss */
+	cached = g_hash_table_lookup (xtext->fontwidth_hash, GUINT_TO_POINTER (c));
+	if (cached)
+		return GPOINTER_TO_INT (cached) - 1;
+
+	width = backend_measure (xtext, str, *mbl_ret);
+	g_hash_table_insert (xtext->fontwidth_hash, GUINT_TO_POINTER (c),
+								GINT_TO_POINTER (width + 1));
+
+	return width;
+}
+
+static int
+backend_get_text_width (GtkXText *xtext, guchar *str, int len, int is_mb)
+{
+	guchar *p, *end;
+	int width, mbl;
+
+	if (!is_mb)
+		return gtk_xtext_text_width_8bit (xtext, str, len);
+
+	if (*str == 0)
+		return 0;
+
+	/* Below U+0300 nothing combines or gets shaped, so adding up the cached
+	   widths gives the same answer as laying the string out. UTF-8 lead
+	   bytes from 0xcc up start U+0300 and beyond. */
+	width = 0;
+	end = str + len;
+	for (p = str; p < end; p += mbl)
+	{
+		if (*p >= 0xcc || p + charlen (p) > end)
+			return backend_measure (xtext, str, len);
+		width += backend_get_char_width (xtext, p, &mbl);
+	}
 
 	return width;
 }
@@ -809,6 +866,8 @@ gtk_xtext_adjustment_changed (GtkAdjustment * adj, GtkXText * xtext)
 		}
 	}
 	xtext->buffer->old_value = adj->value;
+
+	gtk_xtext_spill_check (xtext->buffer);
 }
 
 GtkWidget *
@@ -868,6 +927,14 @@ gtk_xtext_destroy (GtkObject * object)
 		xtext->font = NULL;
 	}
 
+	if (xtext->fontwidth_hash)
+	{
+		g_hash_table_destroy (xtext->fontwidth_hash);
+		xtext->fontwidth_hash = NULL;
+	}
+
+	gtk_xtext_stamp_flush (xtext);
+
 	if (xtext->adj)
 	{
 		g_signal_handlers_disconnect_matched (G_OBJECT (xtext->adj),
@@ -1840,6 +1907,116 @@ gtk_xtext_get_word (GtkXText * xtext, int x, int y, textentry ** ret_ent,
 
 #ifdef MOTION_MONITOR
 
+/* The clickable words of an entry are worked out by urlcheck_function
+   once, the first time the pointer is over it, so that moving the mouse
+   around is only a lookup. Words are cut up the same way as in
+   gtk_xtext_get_word(). */
+
+typedef struct
+{
+	gint16 start;	/* offset into ent->str */
+	gint16 len;		/* not counting a trailing '.' */
+	gint16 end;		/* the '.' still belongs to it for hit-testing */
+} xtext_span;
+
+struct xtext_spans
+{
+	guint gen;		/* xtext->url_gen they were made for */
+	int count;
+	xtext_span span[1];
+};
+
+static struct xtext_spans *
+gtk_xtext_url_spans (GtkXText *xtext, textentry *ent)
+{
+	struct xtext_spans *spans;
+	unsigned char *str = ent->str;
+	char *word;
+	int i, start, len;
+
+	spans = malloc (sizeof (struct xtext_spans) +
+						 (ent->str_len / 2) * sizeof (xtext_span));
+	spans->gen = xtext->url_gen;
+	spans->count = 0;
+
+	i = 1;	/* a word never starts at 0, see gtk_xtext_get_word() */
+	while (i < ent->str_len)
+	{
+		if (is_del (str[i]))
+		{
+			i++;
+			continue;
+		}
+
+		start = i;
+		while (!is_del (str[i]))
+			i++;
+		len = i - start;
+		if (str[i - 1] == '.')
+			len--;
+		if (len == 0)
+			continue;
+
+		word = gtk_xtext_strip_color (str + start, len, xtext->scratch_buffer, NULL, NULL);
+		if (xtext->urlcheck_function (GTK_WIDGET (xtext), word, len) > 0)
+		{
+			spans->span[spans->count].start = start;
+			spans->span[spans->count].len = len;
+			spans->span[spans->count].end = i;
+			spans->count++;
+		}
+	}
+
+	return spans;
+}
+
+/* like gtk_xtext_get_word(), but only finds clickable words */
+
+static int
+gtk_xtext_url_at (GtkXText *xtext, int x, int y, textentry **ret_ent,
+						int *ret_off, int *ret_len)
+{
+	textentry *ent;
+	xtext_span *span;
+	int offset, lo, hi, mid;
+	int out_of_bounds = 0;
+
+	ent = gtk_xtext_find_char (xtext, x, y, &offset, &out_of_bounds);
+	if (!ent || out_of_bounds || offset == ent->str_len || offset < 1)
+		return FALSE;
+
+	if (!ent->spans || ent->spans->gen != xtext->url_gen)
+	{
+		free (ent->spans);
+		ent->spans = gtk_xtext_url_spans (xtext, ent);
+	}
+
+	/* on a delimiter, gtk_xtext_get_word() takes the word after it */
+	if (is_del (ent->str[offset]))
+		offset++;
+
+	lo = 0;
+	hi = ent->spans->count;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		span = &ent->spans->span[mid];
+		if (offset < span->start)
+			hi = mid;
+		else if (offset >= span->end)
+			lo = mid + 1;
+		else
+		{
+			*ret_ent = ent;
+			*ret_off = span->start;
+			*ret_len = span->len;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 static void
 gtk_xtext_unrender_hilight (GtkXText *xtext)
 {
@@ -1891,7 +2068,6 @@ gtk_xtext_motion_notify (GtkWidget * widget, GdkEventMotion * event)
 {
 	GtkXText *xtext = GTK_XTEXT (widget);
 	int tmp, x, y, offset, len, line_x;
-	char *word;
 	textentry *word_ent;
 
 	gdk_window_get_pointer (widget->window, &x, &y, 0);
@@ -1951,43 +2127,39 @@ gtk_xtext_motion_notify (GtkWidget * widget, GdkEventMotion * event)
 	if (xtext->urlcheck_function == NULL)
 		return FALSE;
 
-	word = gtk_xtext_get_word (xtext, x, y, &word_ent, &offset, &len);
-	if (word)
+	if (gtk_xtext_url_at (xtext, x, y, &word_ent, &offset, &len))
 	{
-		if (xtext->urlcheck_function (GTK_WIDGET (xtext), word, len) > 0)
+		if (!xtext->cursor_hand ||
+			 xtext->hilight_ent != word_ent ||
+			 xtext->hilight_start != offset ||
+			 xtext->hilight_end != offset + len)
 		{
-			if (!xtext->cursor_hand ||
-				 xtext->hilight_ent != word_ent ||
-				 xtext->hilight_start != offset ||
-				 xtext->hilight_end != offset + len)
+			if (!xtext->cursor_hand)
 			{
-				if (!xtext->cursor_hand)
-				{
-					gdk_window_set_cursor (GTK_WIDGET (xtext)->window,
-											  		xtext->hand_cursor);
-					xtext->cursor_hand = TRUE;
-				}
+				gdk_window_set_cursor (GTK_WIDGET (xtext)->window,
+										  		xtext->hand_cursor);
+				xtext->cursor_hand = TRUE;
+			}
 
-				/* un-render the old hilight */
-				if (xtext->hilight_ent)
-					gtk_xtext_unrender_hilight (xtext);
+			/* un-render the old hilight */
+			if (xtext->hilight_ent)
+				gtk_xtext_unrender_hilight (xtext);
 
-				xtext->hilight_ent = word_ent;
-				xtext->hilight_start = offset;
-				xtext->hilight_end = offset + len;
+			xtext->hilight_ent = word_ent;
+			xtext->hilight_start = offset;
+			xtext->hilight_end = offset + len;
 
-				xtext->skip_border_fills = TRUE;
-				xtext->render_hilights_only = TRUE;
-				xtext->skip_stamp = TRUE;
+			xtext->skip_border_fills = TRUE;
+			xtext->render_hilights_only = TRUE;
+			xtext->skip_stamp = TRUE;
 
-				gtk_xtext_render_ents (xtext, word_ent, NULL);
+			gtk_xtext_render_ents (xtext, word_ent, NULL);
 
-				xtext->skip_border_fills = FALSE;
-				xtext->render_hilights_only = FALSE;
-				xtext->skip_stamp = FALSE;
-			}
-			return FALSE;
+			xtext->skip_border_fills = FALSE;
+			xtext->render_hilights_only = FALSE;
+			xtext->skip_stamp = FALSE;
 		}
+		return FALSE;
 	}
 
 	gtk_xtext_leave_notify (widget, NULL);
@@ -2432,6 +2604,38 @@ gtk_xtext_get_type (void)
 
 /* strip MIRC colors and other attribs. */
 
+/* Length of the run at 'text' with no control bytes (< 0x20) in it, which
+ * is all of it for most lines. Checks a word at a time: a byte below 0x20
+ * makes (w - 0x2020..) borrow into its top bit while its own top bit is
+ * clear. Sets *mb if the run has any byte >= 128. */
+
+static int
+gtk_xtext_plain_run (unsigned char *text, int len, int *mb)
+{
+	const gulong ones = ~0UL / 255;
+	gulong w;
+	int i = 0;
+
+	while (i + (int) sizeof (w) <= len)
+	{
+		memcpy (&w, text + i, sizeof (w));
+		if ((w - ones * 0x20) & ~w & (ones * 0x80))
+			break;
+		if (w & (ones * 0x80))
+			*mb = TRUE;
+		i += sizeof (w);
+	}
+
+	while (i < len && text[i] >= 0x20)
+	{
+		if (text[i] >= 128)
+			*mb = TRUE;
+		i++;
+	}
+
+	return i;
+}
+
 static char *
 gtk_xtext_strip_color (unsigned char *text, int len, unsigned char *outbuf,
 							  int *newlen, int *mb_ret)
@@ -2441,6 +2645,7 @@ gtk_xtext_strip_color (unsigned char *text, int len, unsigned char *outbuf,
 	int col = FALSE;
 	unsigned char *new_str;
 	int mb = FALSE;
+	int run;
 
 	if (outbuf == NULL)
 		new_str = malloc (len + 2);
@@ -2449,6 +2654,18 @@ gtk_xtext_strip_color (unsigned char *text, int len, unsigned char *outbuf,
 
 	while (len > 0)
 	{
+		/* copy plain text up to the next attribute in one go */
+		if (!col)
+		{
+			run = gtk_xtext_plain_run (text, len, &mb);
+			memcpy (new_str + i, text, run);
+			i += run;
+			text += run;
+			len -= run;
+			if (len <= 0)
+				break;
+		}
+
 		if (*text >= 128)
 			mb = TRUE;
 
@@ -3244,6 +3461,10 @@ shade_image (GdkVisual *visual, void *data, int bpl, int bpp, int w, int h,
 	bg_g = bg & visual->green_mask;
 	bg_b = bg & visual->blue_mask;
 
+	/* SSE2/NEON, if this CPU has it, handles any background */
+	if (shade_image_simd (data, bpl, bpp, depth, w, h, rm, gm, bm, bg))
+		return;
+
 #ifdef USE_MMX
 	/* the MMX routines are about 50% faster at 16-bit. */
 	/* only use MMX routines with a pure black background */
@@ -3812,6 +4033,55 @@ gtk_xtext_find_subline (GtkXText *xtext, textentry *ent, int line)
 	return 0;
 }
 
+/* Formatted timestamps, one slot per second (modulo STAMP_CACHE), so a
+   redraw of the same lines doesn't strftime them all over again. */
+
+static void
+gtk_xtext_stamp_flush (GtkXText *xtext)
+{
+	int i;
+
+	for (i = 0; i < STAMP_CACHE; i++)
+	{
+		g_free (xtext->stamp_cache[i].str);
+		xtext->stamp_cache[i].str = NULL;
+	}
+}
+
+static char *
+gtk_xtext_get_stamp (GtkXText *xtext, time_t stamp, int *len)
+{
+	struct xtext_stamp *slot = &xtext->stamp_cache[stamp % STAMP_CACHE];
+
+	if (!slot->str || slot->stamp != stamp)
+	{
+		g_free (slot->str);
+		slot->len = xtext_get_stamp_str (stamp, &slot->str);
+		slot->stamp = stamp;
+	}
+
+	*len = slot->len;
+	return slot->str;
+}
+
+/* room the timestamps take up in front of the indent */
+
+static void
+gtk_xtext_stamp_measure (GtkXText *xtext)
+{
+	char *time_str;
+	int stamp_size;
+
+	if (!xtext->font)
+		return;
+
+	stamp_size = xtext_get_stamp_str (time (0), &time_str);
+	xtext->stamp_width =
+		gtk_xtext_text_width (xtext, (unsigned char *) time_str, stamp_size,
+								 NULL) + MARGIN;
+	g_free (time_str);
+}
+
 /* render a single line, which may wrap to more lines */
 
 static int
@@ -3826,22 +4096,19 @@ gtk_xtext_render_line (GtkXText * xtext, textentry * ent, int line,
 	indent = ent->indent;
 	start_subline = subline;
 
-#ifdef XCHAT
 	/* draw the timestamp */
 	if (xtext->auto_indent && xtext->buffer->time_stamp && !xtext->skip_stamp)
 	{
-		char *time_str;
-		int stamp_size = xtext_get_stamp_str (ent->stamp, &time_str);
+		int stamp_size;
+		char *time_str = gtk_xtext_get_stamp (xtext, ent->stamp, &stamp_size);
 		int tmp = ent->mb;
 		y = (xtext->fontsize * line) + xtext->font->ascent - xtext->pixel_offset;
 		ent->mb = TRUE;
 		/* XXX: Set up the color here first? */
-		gtk_xtext_render_str (xtext, y, ent, time_str, stamp_size,
+		gtk_xtext_render_str (xtext, y, ent, (unsigned char *) time_str, stamp_size,
 									 win_width, 2, line, TRUE);
 		ent->mb = tmp;
-		g_free (time_str);
 	}
-#endif
 
 	/* draw each line one by one */
 	do
@@ -3983,8 +4250,8 @@ gtk_xtext_recalc_widths (xtext_buffer *buf, int do_str_width)
 int
 gtk_xtext_set_font (GtkXText *xtext, char *name)
 {
-	int i;
-	unsigned char c;
+	int i, len;
+	unsigned char c[6];
 
 	if (xtext->font)
 		backend_font_close (xtext);
@@ -3996,24 +4263,21 @@ gtk_xtext_set_font (GtkXText *xtext, char *name)
 	if (xtext->font == NULL)
 		return FALSE;
 
-	/* measure the width of every char;  only the ASCII ones for XFT */
-	for (i = 0; i < sizeof(xtext->fontwidth)/sizeof(xtext->fontwidth[0]); i++)
+	/* measure the width of every char up to U+00FF, the others are
+		measured as they turn up.  NUL has no width, and Pango won't take it */
+	xtext->fontwidth[0] = 0;
+	for (i = 1; i < sizeof(xtext->fontwidth)/sizeof(xtext->fontwidth[0]); i++)
 	{
-		c = i;
-		xtext->fontwidth[i] = backend_get_text_width (xtext, &c, 1, TRUE);
+		len = g_unichar_to_utf8 (i, (char *)c);
+		xtext->fontwidth[i] = backend_measure (xtext, c, len);
 	}
+	if (xtext->fontwidth_hash)
+		g_hash_table_destroy (xtext->fontwidth_hash);
+	xtext->fontwidth_hash = g_hash_table_new (g_direct_hash, g_direct_equal);
 	xtext->space_width = xtext->fontwidth[' '];
 	xtext->fontsize = xtext->font->ascent + xtext->font->descent;
 
-#ifdef XCHAT
-	{
-		char *time_str;
-		int stamp_size = xtext_get_stamp_str (time(0), &time_str);
-		xtext->stamp_width =
-			gtk_xtext_text_width (xtext, time_str, stamp_size, NULL) + MARGIN;
-		g_free (time_str);
-	}
-#endif
+	gtk_xtext_stamp_measure (xtext);
 
 	gtk_xtext_fix_indent (xtext->buffer);
 
@@ -4103,146 +4367,518 @@ gtk_xtext_save (GtkXText * xtext, int fh)
 	}
 }
 
-/* count how many lines 'ent' will take (with wraps) */
-
-static int
-gtk_xtext_lines_taken (xtext_buffer *buf, textentry * ent)
-{
-	unsigned char *str;
-	int indent, taken, len;
-	int win_width;
+/* ====== entry storage ======
+ * Entries (and their folded text) are carved out of large chunks used as
+ * a FIFO: new ones go at the end of the last chunk, and as lines are
+ * trimmed off the top, whole chunks at the head become empty and are
+ * recycled. Appending or trimming a line costs no malloc or free. */
 
-	win_width = buf->window_width - MARGIN;
+#define CHUNK_SIZE 65536
+#define CHUNK_ALIGN(n) (((n) + 7) & ~7)
 
-	if (ent->str_width + ent->indent < win_width)
-		return 1;
+struct xtext_chunk
+{
+	struct xtext_chunk *next;
+	int size;				/* bytes available after the header */
+	int used;
+	int live;				/* allocations not yet released */
+};
 
-	indent = ent->indent;
-	str = ent->str;
-	taken = 0;
+#define chunk_data(c) ((unsigned char *)(c) + CHUNK_ALIGN (sizeof (struct xtext_chunk)))
 
-	do
+static void
+gtk_xtext_arena_recycle (xtext_buffer *buf, struct xtext_chunk *chunk)
+{
+	/* keep one spare chunk around, so the ring doesn't thrash at a boundary */
+	if (!buf->chunk_spare && chunk->size == CHUNK_SIZE)
 	{
-		len = find_next_wrap (buf->xtext, ent, str, win_width, indent);
-		if (taken < RECORD_WRAPS)
-			ent->wrap_offset[taken] = (str + len) - ent->str;
-		indent = buf->indent;
-		taken++;
-		str += len;
+		chunk->used = 0;
+		chunk->live = 0;
+		buf->chunk_spare = chunk;
+		return;
 	}
-	while (str < ent->str + ent->str_len);
 
-	return taken;
+	buf->memory -= CHUNK_ALIGN (sizeof (struct xtext_chunk)) + chunk->size;
+	free (chunk);
 }
 
-/* Calculate number of actual lines (with wraps), to set adj->lower. *
- * This should only be called when the window resizes.               */
-
-static void
-gtk_xtext_calc_lines (xtext_buffer *buf, int fire_signal)
+static void *
+gtk_xtext_arena_alloc (xtext_buffer *buf, int size)
 {
-	textentry *ent;
-	int width;
-	int height;
-	int lines;
-
-	gdk_drawable_get_size (GTK_WIDGET (buf->xtext)->window, &width, &height);
-	width -= MARGIN;
+	struct xtext_chunk *chunk;
+	void *p;
 
-	if (width < 30 || height < buf->xtext->fontsize || width < buf->indent + 30)
-		return;
+	size = CHUNK_ALIGN (size);
+	chunk = buf->chunk_last;
 
-	lines = 0;
-	ent = buf->text_first;
-	while (ent)
+	if (!chunk || chunk->used + size > chunk->size)
 	{
-		ent->lines_taken = gtk_xtext_lines_taken (buf, ent);
-		lines += ent->lines_taken;
-		ent = ent->next;
+		if (buf->chunk_spare && size <= CHUNK_SIZE)
+		{
+			chunk = buf->chunk_spare;
+			buf->chunk_spare = NULL;
+		} else
+		{
+			/* a line too long for a normal chunk gets one of its own */
+			chunk = malloc (CHUNK_ALIGN (sizeof (struct xtext_chunk)) + MAX (size, CHUNK_SIZE));
+			chunk->size = MAX (size, CHUNK_SIZE);
+			chunk->used = 0;
+			chunk->live = 0;
+			buf->memory += CHUNK_ALIGN (sizeof (struct xtext_chunk)) + chunk->size;
+		}
+		chunk->next = NULL;
+		if (buf->chunk_last)
+			buf->chunk_last->next = chunk;
+		else
+			buf->chunk_first = chunk;
+		buf->chunk_last = chunk;
 	}
 
-	buf->pagetop_ent = NULL;
-	buf->num_lines = lines;
-	gtk_xtext_adjustment_set (buf, fire_signal);
+	p = chunk_data (chunk) + chunk->used;
+	chunk->used += size;
+	chunk->live++;
+
+	return p;
 }
 
-/* find the n-th line in the linked list, this includes wrap calculations */
+/* Give back an allocation. They are released in roughly the order they
+   were made, so 'p' is nearly always in the first chunk or two. */
 
-static textentry *
-gtk_xtext_nth (GtkXText *xtext, int line, int *subline)
+static void
+gtk_xtext_arena_release (xtext_buffer *buf, void *p)
 {
-	int lines = 0;
-	textentry *ent;
+	struct xtext_chunk *chunk;
 
-	ent = xtext->buffer->text_first;
+	chunk = buf->chunk_first;
+	while (chunk && !((unsigned char *)p >= chunk_data (chunk) &&
+							(unsigned char *)p < chunk_data (chunk) + chunk->used))
+		chunk = chunk->next;
+	if (!chunk)
+		return;
+	chunk->live--;
 
-	/* -- optimization -- try to make a short-cut using the pagetop ent */
-	if (xtext->buffer->pagetop_ent)
+	while (buf->chunk_first && buf->chunk_first->live == 0)
 	{
-		if (line == xtext->buffer->pagetop_line)
-		{
-			*subline = xtext->buffer->pagetop_subline;
-			return xtext->buffer->pagetop_ent;
-		}
-		if (line > xtext->buffer->pagetop_line)
-		{
-			/* lets start from the pagetop instead of the absolute beginning */
-			ent = xtext->buffer->pagetop_ent;
-			lines = xtext->buffer->pagetop_line - xtext->buffer->pagetop_subline;
-		}
-		else if (line > xtext->buffer->pagetop_line - line)
+		chunk = buf->chunk_first;
+		if (chunk == buf->chunk_last)
 		{
-			/* move backwards from pagetop */
-			ent = xtext->buffer->pagetop_ent;
-			lines = xtext->buffer->pagetop_line - xtext->buffer->pagetop_subline;
-			while (1)
-			{
-				if (lines <= line)
-				{
-					*subline = line - lines;
-					return ent;
-				}
-				ent = ent->prev;
-				if (!ent)
-					break;
-				lines -= ent->lines_taken;
-			}
-			return 0;
+			chunk->used = 0;	/* empty, start over at the front */
+			break;
 		}
+		buf->chunk_first = chunk->next;
+		gtk_xtext_arena_recycle (buf, chunk);
 	}
-	/* -- end of optimization -- */
+}
 
-	while (ent)
+static void
+gtk_xtext_arena_free_all (xtext_buffer *buf)
+{
+	struct xtext_chunk *chunk, *next;
+
+	for (chunk = buf->chunk_first; chunk; chunk = next)
 	{
-		lines += ent->lines_taken;
-		if (lines > line)
-		{
-			*subline = ent->lines_taken - (lines - line);
-			return ent;
-		}
-		ent = ent->next;
+		next = chunk->next;
+		buf->memory -= CHUNK_ALIGN (sizeof (struct xtext_chunk)) + chunk->size;
+		free (chunk);
+	}
+	buf->chunk_first = NULL;
+	buf->chunk_last = NULL;
+
+	if (buf->chunk_spare)
+	{
+		buf->memory -= CHUNK_ALIGN (sizeof (struct xtext_chunk)) + buf->chunk_spare->size;
+		free (buf->chunk_spare);
+		buf->chunk_spare = NULL;
 	}
-	return 0;
 }
 
-/* render enta (or an inclusive range enta->entb) */
+/* ====== line index ======
+ * A binary indexed (fenwick) tree over every entry's lines_taken, so that
+ * line->entry and entry->line lookups cost O(log n) however much scrollback
+ * there is. Entries take consecutive slots in append order. Removing the top
+ * entry only zeroes its slot; dead slots are squeezed out on the next
+ * rebuild, which also grows the table. */
+
+static void
+gtk_xtext_index_add (xtext_buffer *buf, int slot, int delta)
+{
+	for (slot++; slot <= buf->line_size; slot += slot & -slot)
+		buf->line_tree[slot] += delta;
+}
+
+/* sum of lines_taken of every slot before 'slot' */
 
 static int
-gtk_xtext_render_ents (GtkXText * xtext, textentry * enta, textentry * entb)
+gtk_xtext_index_sum (xtext_buffer *buf, int slot)
 {
-	textentry *ent, *orig_ent, *tmp_ent;
-	int line;
-	int lines_max;
-	int width;
-	int height;
-	int subline;
-	int drawing = FALSE;
+	int sum = 0;
 
-	if (xtext->buffer->indent < MARGIN)
-		xtext->buffer->indent = MARGIN;	  /* 2 pixels is our left margin */
+	for (; slot > 0; slot -= slot & -slot)
+		sum += buf->line_tree[slot];
 
-	gdk_drawable_get_size (GTK_WIDGET (xtext)->window, &width, &height);
-	width -= MARGIN;
+	return sum;
+}
+
+/* rebuild the tree from the linked list in O(n) */
+
+static void
+gtk_xtext_index_rebuild (xtext_buffer *buf)
+{
+	textentry *ent;
+	int count, size, i, j;
+
+	/* slots in front of the first live one are gone for good */
+	for (i = 0; i < buf->line_count && !buf->line_ents[i]; i++)
+		;
+	buf->line_origin += i;
+
+	count = 0;
+	for (ent = buf->text_first; ent; ent = ent->next)
+		count++;
+
+	/* keep at least as many free slots as used ones, so that appends
+	   don't have to rebuild again straight away */
+	size = 256;
+	while (size < count * 2)
+		size *= 2;
+
+	if (size != buf->line_size)
+	{
+		free (buf->line_ents);
+		free (buf->line_tree);
+		buf->line_ents = malloc (size * sizeof (textentry *));
+		buf->line_tree = malloc ((size + 1) * sizeof (int));
+		buf->line_size = size;
+	}
+	memset (buf->line_ents, 0, size * sizeof (textentry *));
+	memset (buf->line_tree, 0, (size + 1) * sizeof (int));
+
+	i = 0;
+	for (ent = buf->text_first; ent; ent = ent->next)
+	{
+		ent->line_slot = i;
+		buf->line_ents[i] = ent;
+		buf->line_tree[i + 1] = ent->lines_taken;
+		i++;
+	}
+	for (i = 1; i <= size; i++)
+	{
+		j = i + (i & -i);
+		if (j <= size)
+			buf->line_tree[j] += buf->line_tree[i];
+	}
+
+	buf->line_count = count;
+
+	if (buf->search_grams)
+		gtk_xtext_search_prune (buf);
+}
+
+/* 'ent' has just been linked in as text_last */
+
+static void
+gtk_xtext_index_append (xtext_buffer *buf, textentry *ent)
+{
+	if (buf->line_count >= buf->line_size)
+	{
+		gtk_xtext_index_rebuild (buf);
+		return;
+	}
+
+	ent->line_slot = buf->line_count++;
+	buf->line_ents[ent->line_slot] = ent;
+	gtk_xtext_index_add (buf, ent->line_slot, ent->lines_taken);
+}
+
+/* 'ent' is text_first and about to be unlinked */
+
+static void
+gtk_xtext_index_remove_top (xtext_buffer *buf, textentry *ent)
+{
+	gtk_xtext_index_add (buf, ent->line_slot, -ent->lines_taken);
+	buf->line_ents[ent->line_slot] = NULL;
+}
+
+static void
+gtk_xtext_index_update (xtext_buffer *buf, textentry *ent, int lines_taken)
+{
+	gtk_xtext_index_add (buf, ent->line_slot, lines_taken - ent->lines_taken);
+	buf->num_lines += lines_taken - ent->lines_taken;
+	ent->lines_taken = lines_taken;
+}
+
+/* a number for 'ent' that, unlike its slot, survives rebuilds */
+
+static guint32
+gtk_xtext_index_seq (xtext_buffer *buf, textentry *ent)
+{
+	return buf->line_origin + ent->line_slot;
+}
+
+/* the entry numbered 'seq', or NULL if it has been removed */
+
+static textentry *
+gtk_xtext_index_ent (xtext_buffer *buf, guint32 seq)
+{
+	if (seq < buf->line_origin || seq - buf->line_origin >= buf->line_count)
+		return NULL;
+
+	return buf->line_ents[seq - buf->line_origin];
+}
+
+/* the line number at which 'ent' starts */
+
+static int
+gtk_xtext_index_line (xtext_buffer *buf, textentry *ent)
+{
+	return gtk_xtext_index_sum (buf, ent->line_slot);
+}
+
+/* the entry covering 'line', and which of its sublines that is */
+
+static textentry *
+gtk_xtext_index_nth (xtext_buffer *buf, int line, int *subline)
+{
+	int pos, step;
+
+	if (line < 0 || buf->line_count == 0)
+		return NULL;
+
+	/* descend to the last slot whose prefix sum is still <= line */
+	pos = 0;
+	for (step = buf->line_size; step; step >>= 1)
+	{
+		if (pos + step <= buf->line_size && buf->line_tree[pos + step] <= line)
+		{
+			pos += step;
+			line -= buf->line_tree[pos];
+		}
+	}
+
+	if (pos >= buf->line_count)
+		return NULL;
+
+	*subline = line;
+	return buf->line_ents[pos];
+}
+
+/* count how many lines 'ent' will take (with wraps) */
+
+static int
+gtk_xtext_lines_taken (xtext_buffer *buf, textentry * ent)
+{
+	unsigned char *str;
+	int indent, taken, len;
+	int win_width;
+
+	win_width = buf->window_width - MARGIN;
+
+	if (ent->str_width + ent->indent < win_width)
+		return 1;
+
+	indent = ent->indent;
+	str = ent->str;
+	taken = 0;
+
+	do
+	{
+		len = find_next_wrap (buf->xtext, ent, str, win_width, indent);
+		if (taken < RECORD_WRAPS)
+			ent->wrap_offset[taken] = (str + len) - ent->str;
+		indent = buf->indent;
+		taken++;
+		str += len;
+	}
+	while (str < ent->str + ent->str_len);
+
+	return taken;
+}
+
+/* rewrap 'ent' for the current window width */
+
+static void
+gtk_xtext_reflow_ent (xtext_buffer *buf, textentry *ent)
+{
+	ent->wrap_gen = buf->wrap_gen;
+	gtk_xtext_index_update (buf, ent, gtk_xtext_lines_taken (buf, ent));
+}
+
+/* make sure every entry on lines [line, line + count) is wrapped for the
+   current width, so it can be rendered */
+
+static void
+gtk_xtext_reflow_range (xtext_buffer *buf, int line, int count)
+{
+	textentry *ent;
+	int subline;
+
+	if (buf->reflow_ent == NULL)
+		return;	/* nothing is stale */
+
+	if (line < 0)
+	{
+		count += line;
+		line = 0;
+	}
+
+	while (count > 0 && (ent = gtk_xtext_index_nth (buf, line, &subline)))
+	{
+		if (ent->wrap_gen != buf->wrap_gen)
+		{
+			/* its start line stays put, look again */
+			gtk_xtext_reflow_ent (buf, ent);
+			continue;
+		}
+		line += ent->lines_taken - subline;
+		count -= ent->lines_taken - subline;
+	}
+}
+
+/* Entries above the viewport changed size by 'delta' lines; keep the view
+   on the same text, much like gtk_xtext_remove_top() does. */
+
+static void
+gtk_xtext_reflow_shift (xtext_buffer *buf, int delta)
+{
+	buf->pagetop_line += delta;
+	buf->old_value += delta;
+	dontscroll (buf);
+	if (buf->xtext->buffer == buf)	/* is it the current buffer? */
+	{
+		buf->xtext->adj->value += delta;
+		buf->xtext->select_start_adj += delta;
+	}
+}
+
+/* rewrap the remaining stale entries a chunk at a time, newest first */
+
+static gboolean
+gtk_xtext_reflow_idle (xtext_buffer *buf)
+{
+	GtkAdjustment *adj = buf->xtext->adj;
+	textentry *ent;
+	int top, old, delta, n;
+
+	top = (buf->xtext->buffer == buf) ? adj->value : buf->old_value;
+	delta = 0;
+
+	for (n = 0; n < REFLOW_CHUNK && buf->reflow_ent; n++)
+	{
+		ent = buf->reflow_ent;
+		buf->reflow_ent = ent->prev;
+		if (ent->wrap_gen == buf->wrap_gen)
+			continue;
+
+		old = ent->lines_taken;
+		gtk_xtext_reflow_ent (buf, ent);
+		if (gtk_xtext_index_line (buf, ent) < top)
+			delta += ent->lines_taken - old;
+	}
+
+	if (buf->scrollbar_down)
+	{
+		buf->old_value = buf->num_lines - adj->page_size;
+		if (buf->old_value < 0)
+			buf->old_value = 0;
+		if (buf->xtext->buffer == buf)
+			adj->value = buf->old_value;
+	} else if (delta)
+	{
+		buf->pagetop_ent = NULL;
+		gtk_xtext_reflow_shift (buf, delta);
+	}
+	gtk_xtext_adjustment_set (buf, TRUE);
+
+	if (buf->reflow_ent)
+		return TRUE;
+
+	buf->reflow_tag = 0;
+	return FALSE;
+}
+
+/* The window width changed: everything needs rewrapping. Only what is on
+ * screen (and a page either side) is done here; the rest keeps its old
+ * line count as an estimate until gtk_xtext_reflow_idle() gets to it, so
+ * resizing costs the same however much scrollback there is. */
+
+static void
+gtk_xtext_calc_lines (xtext_buffer *buf, int fire_signal)
+{
+	textentry *ent;
+	int width;
+	int height;
+	int page;
+	int lines;
+	int top;
+
+	gdk_drawable_get_size (GTK_WIDGET (buf->xtext)->window, &width, &height);
+	width -= MARGIN;
+
+	if (width < 30 || height < buf->xtext->fontsize || width < buf->indent + 30)
+		return;
+
+	buf->wrap_gen++;
+	buf->pagetop_ent = NULL;
+	buf->reflow_ent = buf->text_last;
+	page = height / buf->xtext->fontsize + 1;
+
+	if (buf->scrollbar_down)
+	{
+		lines = 0;
+		ent = buf->text_last;
+		while (ent && lines < page * 2)
+		{
+			gtk_xtext_reflow_ent (buf, ent);
+			lines += ent->lines_taken;
+			ent = ent->prev;
+		}
+		buf->reflow_ent = ent;
+	} else
+	{
+		top = (buf->xtext->buffer == buf) ? buf->xtext->adj->value : buf->old_value;
+		gtk_xtext_reflow_range (buf, top - page, page * 3);
+	}
+
+	if (buf->reflow_ent && !buf->reflow_tag)
+		buf->reflow_tag = g_idle_add ((GSourceFunc) gtk_xtext_reflow_idle, buf);
+
+	gtk_xtext_adjustment_set (buf, fire_signal);
+}
+
+/* find the n-th line in the linked list, this includes wrap calculations */
+
+static textentry *
+gtk_xtext_nth (GtkXText *xtext, int line, int *subline)
+{
+	/* -- optimization -- try to make a short-cut using the pagetop ent */
+	if (xtext->buffer->pagetop_ent && line == xtext->buffer->pagetop_line)
+	{
+		*subline = xtext->buffer->pagetop_subline;
+		return xtext->buffer->pagetop_ent;
+	}
+	/* -- end of optimization -- */
+
+	return gtk_xtext_index_nth (xtext->buffer, line, subline);
+}
+
+/* render enta (or an inclusive range enta->entb) */
+
+static int
+gtk_xtext_render_ents (GtkXText * xtext, textentry * enta, textentry * entb)
+{
+	textentry *ent, *orig_ent, *tmp_ent;
+	int line;
+	int lines_max;
+	int width;
+	int height;
+	int subline;
+	int drawing = FALSE;
+
+	if (xtext->buffer->indent < MARGIN)
+		xtext->buffer->indent = MARGIN;	  /* 2 pixels is our left margin */
+
+	gdk_drawable_get_size (GTK_WIDGET (xtext)->window, &width, &height);
+	width -= MARGIN;
 
 	if (width < 32 || height < xtext->fontsize || width < xtext->buffer->indent + 30)
 		return 0;
@@ -4339,6 +4975,8 @@ gtk_xtext_render_page (GtkXText * xtext)
 	xtext->pixel_offset = 0;
 #endif
 
+	gtk_xtext_reflow_range (xtext->buffer, startline, height / xtext->fontsize + 2);
+
 	subline = line = 0;
 	ent = xtext->buffer->text_first;
 
@@ -4455,6 +5093,15 @@ gtk_xtext_refresh (GtkXText * xtext, int do_trans)
 	}
 }
 
+static void
+gtk_xtext_free_ent (xtext_buffer *buf, textentry *ent)
+{
+	free (ent->spans);
+	if (ent->fold != ent->str)
+		gtk_xtext_arena_release (buf, ent->fold);
+	gtk_xtext_arena_release (buf, ent);
+}
+
 /* remove the topline from the list */
 
 static void
@@ -4476,6 +5123,7 @@ gtk_xtext_remove_top (xtext_buffer *buffer)
 	{
 		buffer->xtext->adj->value -= ent->lines_taken;
 		buffer->xtext->select_start_adj -= ent->lines_taken;
+		buffer->xtext->top_removed = TRUE;
 	}
 
 	if (ent == buffer->pagetop_ent)
@@ -4492,13 +5140,21 @@ gtk_xtext_remove_top (xtext_buffer *buffer)
 
 	if (buffer->marker_pos == ent) buffer->marker_pos = NULL;
 
-	free (ent);
+	if (buffer->reflow_ent == ent)
+		buffer->reflow_ent = NULL;	/* it was the last one left */
+
+	if (buffer->search_ent == ent)
+		buffer->search_ent = NULL;
+
+	buffer->ent_count--;
+	gtk_xtext_index_remove_top (buffer, ent);
+	gtk_xtext_free_ent (buffer, ent);
 }
 
 void
 gtk_xtext_clear (xtext_buffer *buf)
 {
-	textentry *next;
+	textentry *ent;
 
 	buf->scrollbar_down = TRUE;
 	buf->last_ent_start = NULL;
@@ -4506,13 +5162,36 @@ gtk_xtext_clear (xtext_buffer *buf)
 	buf->marker_pos = NULL;
 	dontscroll (buf);
 
-	while (buf->text_first)
+	for (ent = buf->text_first; ent; ent = ent->next)
+		free (ent->spans);
+	gtk_xtext_arena_free_all (buf);
+	buf->text_first = NULL;
+	buf->text_last = NULL;
+	buf->reflow_ent = NULL;
+	buf->search_ent = NULL;
+	buf->num_lines = 0;
+	buf->ent_count = 0;
+	if (buf->spill_fp)
+	{
+		/* the spilled history goes too */
+		rewind (buf->spill_fp);
+		if (ftruncate (fileno (buf->spill_fp), 0) != 0)
+			gtk_xtext_spill_close (buf);
+		else
+		{
+			g_array_set_size (buf->spill_offsets, 0);
+			buf->spill_end = 0;
+			buf->spill_first = 0;
+		}
+	}
+	if (buf->search_grams)
 	{
-		next = buf->text_first->next;
-		free (buf->text_first);
-		buf->text_first = next;
+		g_hash_table_destroy (buf->search_grams);
+		buf->search_grams = NULL;
 	}
-	buf->text_last = NULL;
+	buf->line_origin += buf->line_count;
+	buf->line_count = 0;
+	gtk_xtext_index_rebuild (buf);
 
 	if (buf->xtext->buffer == buf)
 	{
@@ -4559,96 +5238,312 @@ gtk_xtext_check_marker_visibility (GtkXText * xtext)
 		xtext->buffer->marker_seen = TRUE;
 }
 
+/* ====== search ======
+ * Every entry keeps a casefolded copy of its text, made once when it is
+ * appended. The first search also builds a trigram index over the folded
+ * text, which is then kept up to date as entries come and go, so that a
+ * search only has to look at entries sharing the needle's rarest trigram. */
+
+/* Lowercase 'text' into 'out' (len + 1 bytes) without changing the byte
+ * length of any character, so offsets into the result are offsets into
+ * 'text' too. With out == NULL, just tell whether folding changes it. */
+
+static int
+gtk_xtext_fold (unsigned char *text, int len, unsigned char *out)
+{
+	gunichar c, lc;
+	int i, n, changed = FALSE;
+
+	if (out)
+	{
+		memcpy (out, text, len);
+		out[len] = 0;
+	}
+
+	for (i = 0; i < len; i += n)
+	{
+		n = 1;
+		if (text[i] < 128)
+		{
+			c = text[i];
+			lc = g_ascii_tolower (c);
+		} else
+		{
+			n = charlen (text + i);
+			if (i + n > len)
+				break;
+			c = g_utf8_get_char_validated ((char *)text + i, n);
+			if (c == (gunichar)-1 || c == (gunichar)-2)
+			{
+				n = 1;
+				continue;
+			}
+			lc = g_unichar_tolower (c);
+			if (g_unichar_to_utf8 (lc, NULL) != n)
+				continue;
+		}
+		if (lc == c)
+			continue;
+
+		if (!out)
+			return TRUE;
+		changed = TRUE;
+		if (n == 1)
+			out[i] = lc;
+		else
+			g_unichar_to_utf8 (lc, (char *)out + i);
+	}
+
+	return changed;
+}
+
+#define gram_key(s) GUINT_TO_POINTER ((s)[0] | ((s)[1] << 8) | ((s)[2] << 16))
+
+static void
+gtk_xtext_search_add (xtext_buffer *buf, textentry *ent)
+{
+	GArray *seqs;
+	guint32 seq;
+	int i;
+
+	seq = gtk_xtext_index_seq (buf, ent);
+
+	for (i = 0; i + 3 <= ent->str_len; i++)
+	{
+		seqs = g_hash_table_lookup (buf->search_grams, gram_key (ent->fold + i));
+		if (!seqs)
+		{
+			seqs = g_array_new (FALSE, FALSE, sizeof (guint32));
+			g_hash_table_insert (buf->search_grams, gram_key (ent->fold + i), seqs);
+		}
+		/* entries are added in order, so a repeat can only be the last one */
+		if (seqs->len == 0 || g_array_index (seqs, guint32, seqs->len - 1) != seq)
+			g_array_append_val (seqs, seq);
+	}
+}
+
+static void
+gtk_xtext_search_free_gram (GArray *seqs)
+{
+	g_array_free (seqs, TRUE);
+}
+
+static void
+gtk_xtext_search_build (xtext_buffer *buf)
+{
+	textentry *ent;
+
+	buf->search_grams = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+											(GDestroyNotify) gtk_xtext_search_free_gram);
+	for (ent = buf->text_first; ent; ent = ent->next)
+		gtk_xtext_search_add (buf, ent);
+}
+
+static gboolean
+gtk_xtext_search_prune_gram (gpointer key, GArray *seqs, xtext_buffer *buf)
+{
+	guint i;
+
+	for (i = 0; i < seqs->len; i++)
+		if (g_array_index (seqs, guint32, i) >= buf->line_origin)
+			break;
+	if (i)
+		g_array_remove_range (seqs, 0, i);
+
+	return seqs->len == 0;
+}
+
+/* drop the removed entries, called whenever the line index is compacted */
+
+static void
+gtk_xtext_search_prune (xtext_buffer *buf)
+{
+	g_hash_table_foreach_remove (buf->search_grams,
+										  (GHRFunc) gtk_xtext_search_prune_gram, buf);
+}
+
+/* offset of 'nee' in 'ent', or -1 */
+
+static int
+gtk_xtext_search_ent (textentry *ent, const char *nee, gboolean case_match)
+{
+	char *hay, *str;
+
+	hay = (char *) (case_match ? ent->str : ent->fold);
+	str = g_strstr_len (hay, ent->str_len, nee);
+	if (!str)
+		return -1;
+
+	return str - hay;
+}
+
+/* find the first entry after 'start' (before it, if backward) containing
+   'nee', looking only at entries that have the needle's rarest trigram */
+
+static textentry *
+gtk_xtext_search_grams (xtext_buffer *buf, unsigned char *fold, const char *nee,
+								textentry *start, gboolean case_match, gboolean backward,
+								int *offset)
+{
+	GArray *seqs, *best = NULL;
+	textentry *ent;
+	guint32 seq, from;
+	int i, lo, hi, len;
+
+	len = strlen ((char *)fold);
+	for (i = 0; i + 3 <= len; i++)
+	{
+		seqs = g_hash_table_lookup (buf->search_grams, gram_key (fold + i));
+		if (!seqs)
+			return NULL;	/* no entry has this trigram */
+		if (!best || seqs->len < best->len)
+			best = seqs;
+	}
+
+	/* binary search for the first candidate past 'start' */
+	lo = 0;
+	hi = best->len;
+	if (start)
+	{
+		from = gtk_xtext_index_seq (buf, start);
+		while (lo < hi)
+		{
+			i = (lo + hi) / 2;
+			if (g_array_index (best, guint32, i) < from + !backward)
+				lo = i + 1;
+			else
+				hi = i;
+		}
+	} else if (backward)
+		lo = best->len;
+
+	if (backward)
+	{
+		for (i = lo - 1; i >= 0; i--)
+		{
+			seq = g_array_index (best, guint32, i);
+			ent = gtk_xtext_index_ent (buf, seq);
+			if (ent && (*offset = gtk_xtext_search_ent (ent, nee, case_match)) != -1)
+				return ent;
+		}
+	} else
+	{
+		for (i = lo; i < best->len; i++)
+		{
+			seq = g_array_index (best, guint32, i);
+			ent = gtk_xtext_index_ent (buf, seq);
+			if (ent && (*offset = gtk_xtext_search_ent (ent, nee, case_match)) != -1)
+				return ent;
+		}
+	}
+
+	return NULL;
+}
+
 textentry *
 gtk_xtext_search (GtkXText * xtext, const gchar *text, textentry *start, gboolean case_match, gboolean backward)
 {
+	xtext_buffer *buf = xtext->buffer;
 	textentry *ent, *fent;
-	int line;
-	gchar *str = NULL, *nee = NULL, *hay = NULL;	/* needle in haystack */
+	int line, offset = -1;
+	unsigned char *fold;
+	const gchar *nee;	/* needle in haystack */
+	int len;
 
-	gtk_xtext_selection_clear_full (xtext->buffer);
-	xtext->buffer->last_ent_start = NULL;
-	xtext->buffer->last_ent_end = NULL;
+	gtk_xtext_selection_clear_full (buf);
+	buf->last_ent_start = NULL;
+	buf->last_ent_end = NULL;
 
 	/* set up text comparand for Case Match or Ignore */
-	if (case_match)
-		nee = g_strdup (text);
-	else
-		nee = g_utf8_casefold (text, strlen (text));
-
-	/* Validate that start gives a currently valid ent pointer */
-	ent = xtext->buffer->text_first;
-	while (ent)
+	len = strlen (text);
+	fold = (unsigned char *)text;
+	if (gtk_xtext_fold ((unsigned char *)text, len, NULL))
 	{
-		if (ent == start)
-			break;
-		ent = ent->next;
+		fold = malloc (len + 1);
+		gtk_xtext_fold ((unsigned char *)text, len, fold);
 	}
-	if (!ent)
-		start = NULL;
+	nee = case_match ? text : (gchar *)fold;
 
-	/* Choose first ent to look at */
-	if (start)
-		ent = backward? start->prev: start->next;
-	else
-		ent = backward? xtext->buffer->text_last: xtext->buffer->text_first;
+	/* Validate that start gives a currently valid ent pointer. It's almost
+	   always the last hit ("find next"), which we know is still alive. */
+	if (start && start != buf->search_ent)
+	{
+		ent = buf->text_first;
+		while (ent)
+		{
+			if (ent == start)
+				break;
+			ent = ent->next;
+		}
+		if (!ent)
+			start = NULL;
+	}
 
-	/* Search from there to one end or the other until found */
-	while (ent)
+	if (len >= 3)
 	{
-		/* If Case Ignore, fold before & free after calling strstr */
-		if (case_match)
-			hay = g_strdup ((char *)ent->str);
+		if (!buf->search_grams)
+			gtk_xtext_search_build (buf);
+		ent = gtk_xtext_search_grams (buf, fold, nee, start, case_match,
+												backward, &offset);
+	} else
+	{
+		/* too short for the index, scan the folded text */
+		if (start)
+			ent = backward? start->prev: start->next;
 		else
-			hay = g_utf8_casefold ((char *)ent->str, strlen ((char *)ent->str));
-		/* Try to find the needle in this haystack */
-		str = g_strstr_len (hay, strlen (hay), nee);
-		g_free (hay);
-		if (str)
-			break;
-		ent = backward? ent->prev: ent->next;
+			ent = backward? buf->text_last: buf->text_first;
+
+		while (ent)
+		{
+			offset = gtk_xtext_search_ent (ent, nee, case_match);
+			if (offset != -1)
+				break;
+			ent = backward? ent->prev: ent->next;
+		}
 	}
 	fent = ent;
+	buf->search_ent = fent;
 
 	/* Save distance to start, end of found string */
 	if (ent)
 	{
-		ent->mark_start = str - hay;
+		ent->mark_start = offset;
 		ent->mark_end = ent->mark_start + strlen (nee);
 
 		/* is the match visible? Might need to scroll */
 		if (!gtk_xtext_check_ent_visibility (xtext, ent, 0))
 		{
-			ent = xtext->buffer->text_first;
-			line = 0;
-			while (ent)
-			{
-				line += ent->lines_taken;
-				ent = ent->next;
-				if (ent == fent)
-					break;
-			}
+			line = gtk_xtext_index_line (buf, fent);
 			while (line > xtext->adj->upper - xtext->adj->page_size)
 				line--;
 
 			xtext->adj->value = line;
-			xtext->buffer->scrollbar_down = FALSE;
+			buf->scrollbar_down = FALSE;
 			gtk_adjustment_changed (xtext->adj);
 		}
 	}
 
-	g_free (nee);
+	if (fold != (unsigned char *)text)
+		free (fold);
 	gtk_widget_queue_draw (GTK_WIDGET (xtext));
 
 	return fent;
 }
 
+/* Draw everything appended since the last frame in one go. Lines that
+ * were already on screen are moved with a blit in gtk_xtext_render_page(),
+ * only the newly exposed ones are rendered. */
+
 static int
 gtk_xtext_render_page_timeout (GtkXText * xtext)
 {
 	GtkAdjustment *adj = xtext->adj;
+	gdouble upper, value;
+	int top_removed = xtext->top_removed;
 
 	xtext->add_io_tag = 0;
+	xtext->top_removed = FALSE;
+	g_get_current_time (&xtext->last_frame);
 
 	/* less than a complete page? */
 	if (xtext->buffer->num_lines <= adj->page_size)
@@ -4666,10 +5561,17 @@ gtk_xtext_render_page_timeout (GtkXText * xtext)
 		gtk_xtext_render_page (xtext);
 	} else
 	{
-		gtk_xtext_adjustment_set (xtext->buffer, TRUE);
-		if (xtext->indent_changed)
+		/* scrolled back: only the scrollbar needs to know, if anything.
+		   gtk_xtext_remove_top() moves adj->value without telling it. */
+		upper = adj->upper;
+		value = adj->value;
+		gtk_xtext_adjustment_set (xtext->buffer, FALSE);
+		if (top_removed || adj->upper != upper || adj->value != value)
+			gtk_adjustment_changed (adj);
+		if (xtext->indent_changed || adj->value != value)
 		{
 			xtext->indent_changed = FALSE;
+			xtext->buffer->old_value = adj->value;
 			gtk_xtext_render_page (xtext);
 		}
 	}
@@ -4677,6 +5579,314 @@ gtk_xtext_render_page_timeout (GtkXText * xtext)
 	return 0;
 }
 
+/* ====== disk spill ======
+ * With gtk_xtext_set_spill(), only the newest spill_hot entries stay in
+ * memory. Older ones are written, oldest first, to an append-only file
+ * and dropped; spill_offsets says where each record starts. Scrolling to
+ * the top of what is in memory maps the file and reads the previous
+ * SPILL_PAGE records back in; they are dropped again (without another
+ * write, they're already on disk) once they are SPILL_PAGE lines above
+ * the view, or once the view is back at the bottom. Whatever is below the
+ * view while scrolled back has to stay, so max_lines still applies then:
+ * nothing more is read back past it, and the top goes as it always does.
+ * If the file can't be written or read back (disk full, say), spilling
+ * is turned off and what was on disk is dropped, as max_lines would. */
+
+#define SPILL_PAGE 500
+
+typedef struct
+{
+	gint64 stamp;
+	gint32 str_len;
+	gint32 left_len;
+	gint32 left_color;
+	gint32 right_color;
+} spill_record;				/* followed by str_len bytes of text */
+
+static gboolean
+gtk_xtext_spill_write (xtext_buffer *buf, textentry *ent)
+{
+	spill_record rec;
+
+	rec.stamp = ent->stamp;
+	rec.str_len = ent->str_len;
+	rec.left_len = ent->left_len;
+	rec.left_color = ent->left_color;
+	rec.right_color = ent->right_color;
+
+	if (fwrite (&rec, sizeof (rec), 1, buf->spill_fp) != 1 ||
+		 fwrite (ent->str, 1, ent->str_len, buf->spill_fp) != (size_t) ent->str_len)
+		return FALSE;
+
+	g_array_append_val (buf->spill_offsets, buf->spill_end);
+	buf->spill_end += sizeof (rec) + ent->str_len;
+	return TRUE;
+}
+
+static gboolean
+gtk_xtext_spill_full (xtext_buffer *buf)
+{
+	return buf->xtext->max_lines > 2 && buf->xtext->max_lines < buf->num_lines;
+}
+
+/* drop the oldest entries: past max_lines, down to spill_hot at the bottom,
+   otherwise the ones well above the view */
+
+static int
+gtk_xtext_spill_trim (xtext_buffer *buf)
+{
+	int changed = FALSE;
+	int top;
+
+	while (buf->text_first != buf->text_last)
+	{
+		/* max_lines goes first, wherever the view is */
+		if (!gtk_xtext_spill_full (buf))
+		{
+			if (buf->scrollbar_down && buf->ent_count <= buf->spill_hot)
+				break;
+			top = (buf->xtext->buffer == buf) ? buf->xtext->adj->value : buf->old_value;
+			if (!buf->scrollbar_down && top - buf->text_first->lines_taken < SPILL_PAGE)
+				break;
+		}
+
+		if (buf->spill_first == buf->spill_offsets->len &&
+			 !gtk_xtext_spill_write (buf, buf->text_first))
+		{
+			gtk_xtext_spill_close (buf);
+			break;
+		}
+		buf->spill_first++;
+		gtk_xtext_remove_top (buf);
+		changed = TRUE;
+	}
+
+	return changed;
+}
+
+/* read the 'count' records before text_first back in */
+
+static void
+gtk_xtext_spill_page_in (xtext_buffer *buf, int count)
+{
+	GMappedFile *map;
+	spill_record rec;
+	struct xtext_chunk *chunk;
+	textentry *ent, *first, *last;
+	const char *data;
+	gsize length;
+	long offset;
+	int i, from, size, lines, mb;
+
+	from = MAX (0, buf->spill_first - count);
+	if (from == buf->spill_first || !buf->text_first)
+		return;
+
+	/* buffered writes that failed only show up here */
+	if (fflush (buf->spill_fp) != 0)
+	{
+		gtk_xtext_spill_close (buf);
+		return;
+	}
+	map = g_mapped_file_new (buf->spill_path, FALSE, NULL);
+	if (!map)
+		return;
+	data = g_mapped_file_get_contents (map);
+	length = g_mapped_file_get_length (map);
+
+	/* one chunk for the whole page, in front of all the others; every
+	   record has to be inside the file before anything is copied */
+	size = 0;
+	for (i = from; i < buf->spill_first; i++)
+	{
+		offset = g_array_index (buf->spill_offsets, long, i);
+		if (offset < 0 || (gsize) offset > length || length - offset < sizeof (rec))
+			break;
+		memcpy (&rec, data + offset, sizeof (rec));
+		if (rec.str_len < 0 || (gsize) rec.str_len > length - offset - sizeof (rec) ||
+			 rec.left_len < -1 || rec.left_len > rec.str_len)
+			break;
+		size += CHUNK_ALIGN (sizeof (textentry) + rec.str_len + 1);
+		size += CHUNK_ALIGN (rec.str_len + 1);	/* room for ->fold */
+	}
+	if (i < buf->spill_first)
+	{
+		/* truncated behind our back, or never fully written */
+		g_mapped_file_free (map);
+		gtk_xtext_spill_close (buf);
+		return;
+	}
+	chunk = malloc (CHUNK_ALIGN (sizeof (struct xtext_chunk)) + size);
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->live = 0;
+	chunk->next = buf->chunk_first;
+	buf->chunk_first = chunk;
+	buf->memory += CHUNK_ALIGN (sizeof (struct xtext_chunk)) + size;
+
+	first = last = NULL;
+	lines = 0;
+	for (i = from; i < buf->spill_first; i++)
+	{
+		offset = g_array_index (buf->spill_offsets, long, i);
+		memcpy (&rec, data + offset, sizeof (rec));
+
+		ent = (textentry *) (chunk_data (chunk) + chunk->used);
+		chunk->used += CHUNK_ALIGN (sizeof (textentry) + rec.str_len + 1);
+		chunk->live++;
+		ent->str = (unsigned char *) ent + sizeof (textentry);
+		memcpy (ent->str, data + offset + sizeof (rec), rec.str_len);
+		ent->str[rec.str_len] = 0;
+		ent->str_len = rec.str_len;
+		ent->left_len = rec.left_len;
+		ent->left_color = rec.left_color;
+		ent->right_color = rec.right_color;
+		ent->stamp = rec.stamp;
+
+		ent->fold = ent->str;
+		if (gtk_xtext_fold (ent->str, ent->str_len, NULL))
+		{
+			ent->fold = chunk_data (chunk) + chunk->used;
+			chunk->used += CHUNK_ALIGN (rec.str_len + 1);
+			chunk->live++;
+			gtk_xtext_fold (ent->str, ent->str_len, ent->fold);
+		}
+
+		ent->indent = MARGIN;
+		if (ent->left_len != -1)
+		{
+			ent->indent = (buf->indent - gtk_xtext_text_width (buf->xtext, ent->str,
+												ent->left_len, NULL)) - buf->xtext->space_width;
+			if (ent->indent < MARGIN)
+				ent->indent = MARGIN;
+		}
+		ent->str_width = gtk_xtext_text_width (buf->xtext, ent->str, ent->str_len, &mb);
+		ent->mb = mb ? TRUE : FALSE;
+		ent->mark_start = -1;
+		ent->mark_end = -1;
+		ent->spans = NULL;
+		ent->lines_taken = gtk_xtext_lines_taken (buf, ent);
+		ent->wrap_gen = buf->wrap_gen;
+		lines += ent->lines_taken;
+
+		ent->prev = last;
+		ent->next = NULL;
+		if (last)
+			last->next = ent;
+		else
+			first = ent;
+		last = ent;
+	}
+	g_mapped_file_free (map);
+
+	last->next = buf->text_first;
+	buf->text_first->prev = last;
+	buf->text_first = first;
+	buf->ent_count += buf->spill_first - from;
+	buf->spill_first = from;
+
+	/* seqs of the new entries would go backwards; build it again on demand */
+	if (buf->search_grams)
+	{
+		g_hash_table_destroy (buf->search_grams);
+		buf->search_grams = NULL;
+	}
+	gtk_xtext_index_rebuild (buf);
+
+	/* same text stays in view, it's just further down now */
+	buf->num_lines += lines;
+	gtk_xtext_reflow_shift (buf, lines);
+	if (buf->xtext->buffer == buf)
+		gtk_xtext_adjustment_set (buf, TRUE);
+}
+
+/* called when the view moves; page in at the top, trim at the bottom */
+
+static void
+gtk_xtext_spill_check (xtext_buffer *buf)
+{
+	if (!buf->spill_fp)
+		return;
+
+	if (buf->xtext->adj->value < 1 && buf->spill_first > 0)
+	{
+		if (!gtk_xtext_spill_full (buf))
+			gtk_xtext_spill_page_in (buf, SPILL_PAGE);
+	} else if (gtk_xtext_spill_trim (buf))
+		gtk_xtext_adjustment_set (buf, TRUE);
+}
+
+static void
+gtk_xtext_spill_close (xtext_buffer *buf)
+{
+	if (!buf->spill_fp)
+		return;
+
+	fclose (buf->spill_fp);
+	unlink (buf->spill_path);
+	free (buf->spill_path);
+	g_array_free (buf->spill_offsets, TRUE);
+	buf->spill_fp = NULL;
+	buf->spill_path = NULL;
+	buf->spill_offsets = NULL;
+	buf->spill_end = 0;
+	buf->spill_first = 0;
+}
+
+gboolean
+gtk_xtext_set_spill (xtext_buffer *buf, const char *path, int hot_lines)
+{
+	FILE *fp = NULL;
+
+	if (path)
+	{
+		fp = fopen (path, "w+b");
+		if (!fp)
+			return FALSE;
+	}
+
+	/* whatever had been spilled so far goes with the old file */
+	gtk_xtext_spill_close (buf);
+	if (!path)
+		return TRUE;
+
+	buf->spill_fp = fp;
+	buf->spill_path = strdup (path);
+	buf->spill_offsets = g_array_new (FALSE, FALSE, sizeof (long));
+	buf->spill_hot = MAX (hot_lines, 1);
+
+	if (gtk_xtext_spill_trim (buf))
+		gtk_xtext_adjustment_set (buf, TRUE);
+
+	return TRUE;
+}
+
+/* Appends are drawn in batches, at most once per frame: as soon as the
+ * current burst of messages has been added if the last frame was long
+ * enough ago, otherwise when the next one is due. */
+
+static void
+gtk_xtext_schedule_frame (GtkXText *xtext)
+{
+	GTimeVal now;
+	glong since;
+
+	g_get_current_time (&now);
+	since = (now.tv_sec - xtext->last_frame.tv_sec) * 1000 +
+			  (now.tv_usec - xtext->last_frame.tv_usec) / 1000;
+
+	if (since < 0 || since >= FRAME_INTERVAL)
+		xtext->add_io_tag = g_idle_add_full (GDK_PRIORITY_REDRAW,
+														 (GSourceFunc)
+														 gtk_xtext_render_page_timeout,
+														 xtext, NULL);
+	else
+		xtext->add_io_tag = g_timeout_add (FRAME_INTERVAL - since,
+													  (GSourceFunc)
+													  gtk_xtext_render_page_timeout,
+													  xtext);
+}
+
 /* append a textentry to our linked list */
 
 static void
@@ -4693,6 +5903,12 @@ gtk_xtext_append_entry (xtext_buffer *buf, textentry * ent)
 		i++;
 	}
 
+	ent->fold = ent->str;
+	if (gtk_xtext_fold (ent->str, ent->str_len, NULL))
+	{
+		ent->fold = gtk_xtext_arena_alloc (buf, ent->str_len + 1);
+		gtk_xtext_fold (ent->str, ent->str_len, ent->fold);
+	}
 	ent->stamp = time (0);
 	ent->str_width = gtk_xtext_text_width (buf->xtext, ent->str, ent->str_len, &mb);
 	ent->mb = FALSE;
@@ -4700,6 +5916,7 @@ gtk_xtext_append_entry (xtext_buffer *buf, textentry * ent)
 		ent->mb = TRUE;
 	ent->mark_start = -1;
 	ent->mark_end = -1;
+	ent->spans = NULL;
 	ent->next = NULL;
 
 	if (ent->indent < MARGIN)
@@ -4714,7 +5931,11 @@ gtk_xtext_append_entry (xtext_buffer *buf, textentry * ent)
 	buf->text_last = ent;
 
 	ent->lines_taken = gtk_xtext_lines_taken (buf, ent);
+	ent->wrap_gen = buf->wrap_gen;
 	buf->num_lines += ent->lines_taken;
+	gtk_xtext_index_append (buf, ent);
+	if (buf->search_grams)
+		gtk_xtext_search_add (buf, ent);
 
 	if (buf->reset_marker_pos || 
 		((buf->marker_pos == NULL || buf->marker_seen) && (buf->xtext->buffer != buf || 
@@ -4730,7 +5951,10 @@ gtk_xtext_append_entry (xtext_buffer *buf, textentry * ent)
 		buf->reset_marker_pos = FALSE;
 	}
 
-	if (buf->xtext->max_lines > 2 && buf->xtext->max_lines < buf->num_lines)
+	buf->ent_count++;
+	if (buf->spill_fp)
+		gtk_xtext_spill_trim (buf);
+	else if (buf->xtext->max_lines > 2 && buf->xtext->max_lines < buf->num_lines)
 	{
 		gtk_xtext_remove_top (buf);
 	}
@@ -4751,10 +5975,7 @@ gtk_xtext_append_entry (xtext_buffer *buf, textentry * ent)
 				g_source_remove (buf->xtext->io_tag);
 				buf->xtext->io_tag = 0;
 			}
-			buf->xtext->add_io_tag = g_timeout_add (REFRESH_TIMEOUT * 2,
-															(GSourceFunc)
-															gtk_xtext_render_page_timeout,
-															buf->xtext);
+			gtk_xtext_schedule_frame (buf->xtext);
 		}
 	} else if (buf->scrollbar_down)
 	{
@@ -4789,7 +6010,7 @@ gtk_xtext_append_indent (xtext_buffer *buf,
 	if (right_text[right_len-1] == '\n')
 		right_len--;
 
-	ent = malloc (left_len + right_len + 2 + sizeof (textentry));
+	ent = gtk_xtext_arena_alloc (buf, left_len + right_len + 2 + sizeof (textentry));
 	str = (unsigned char *) ent + sizeof (textentry);
 
 	memcpy (str, left_text, left_len);
@@ -4847,7 +6068,7 @@ gtk_xtext_append (xtext_buffer *buf, unsigned char *text, int len)
 	if (len >= sizeof (buf->xtext->scratch_buffer))
 		len = sizeof (buf->xtext->scratch_buffer) - 1;
 
-	ent = malloc (len + 1 + sizeof (textentry));
+	ent = gtk_xtext_arena_alloc (buf, len + 1 + sizeof (textentry));
 	ent->str = (unsigned char *) ent + sizeof (textentry);
 	ent->str_len = len;
 	if (len)
@@ -4923,6 +6144,9 @@ void
 gtk_xtext_set_time_stamp (xtext_buffer *buf, gboolean time_stamp)
 {
 	buf->time_stamp = time_stamp;
+	/* the format may have changed too */
+	gtk_xtext_stamp_flush (buf->xtext);
+	gtk_xtext_stamp_measure (buf->xtext);
 }
 
 void
@@ -4940,6 +6164,7 @@ void
 gtk_xtext_set_urlcheck_function (GtkXText *xtext, int (*urlcheck_function) (GtkWidget *, char *, int))
 {
 	xtext->urlcheck_function = urlcheck_function;
+	xtext->url_gen++;	/* what it said before may not hold any more */
 }
 
 void
@@ -5051,10 +6276,16 @@ gtk_xtext_buffer_new (GtkXText *xtext)
 	return buf;
 }
 
+gsize
+gtk_xtext_buffer_get_memory (xtext_buffer *buf)
+{
+	return buf->memory;
+}
+
 void
 gtk_xtext_buffer_free (xtext_buffer *buf)
 {
-	textentry *ent, *next;
+	textentry *ent;
 
 	if (buf->xtext->buffer == buf)
 		buf->xtext->buffer = buf->xtext->orig_buffer;
@@ -5062,13 +6293,17 @@ gtk_xtext_buffer_free (xtext_buffer *buf)
 	if (buf->xtext->selection_buffer == buf)
 		buf->xtext->selection_buffer = NULL;
 
-	ent = buf->text_first;
-	while (ent)
-	{
-		next = ent->next;
-		free (ent);
-		ent = next;
-	}
+	if (buf->reflow_tag)
+		g_source_remove (buf->reflow_tag);
+
+	for (ent = buf->text_first; ent; ent = ent->next)
+		free (ent->spans);
+	gtk_xtext_arena_free_all (buf);
+	gtk_xtext_spill_close (buf);
 
+	if (buf->search_grams)
+		g_hash_table_destroy (buf->search_grams);
+	free (buf->line_ents);
+	free (buf->line_tree);
 	free (buf);
 }
@@ -1,6 +1,7 @@
 #ifndef __XTEXT_H__
 #define __XTEXT_H__
 
+#include <stdio.h>
 #include <gtk/gtkadjustment.h>
 #ifdef USE_XFT
 #include <X11/Xft/Xft.h>
@@ -65,6 +66,32 @@ typedef struct {
 	int num_lines;
 	int indent;						  /* position of separator (pixels) from left */
 
+	textentry **line_ents;		  /* line index: entry in each slot */
+	int *line_tree;				  /* fenwick tree over lines_taken, 1-based */
+	int line_size;					  /* allocated slots (power of 2) */
+	int line_count;				  /* slots in use */
+	guint32 line_origin;			  /* slots compacted away so far */
+
+	guint wrap_gen;				  /* bumped whenever the wrap width changes */
+	textentry *reflow_ent;		  /* next entry for the idle reflow (walks up) */
+	guint reflow_tag;				  /* idle source doing the reflow */
+
+	GHashTable *search_grams;	  /* trigram -> GArray of entry seqs */
+	textentry *search_ent;		  /* last search hit */
+
+	struct xtext_chunk *chunk_first;	/* entry storage, oldest first */
+	struct xtext_chunk *chunk_last;
+	struct xtext_chunk *chunk_spare;
+	gsize memory;					  /* bytes of entry storage held */
+
+	FILE *spill_fp;				  /* older entries, see gtk_xtext_set_spill() */
+	char *spill_path;
+	GArray *spill_offsets;		  /* file offset of each record written */
+	long spill_end;				  /* size of the file */
+	int spill_first;				  /* record number of text_first */
+	int spill_hot;					  /* entries to keep in memory */
+	int ent_count;					  /* entries in memory */
+
 	textentry *marker_pos;
 
 	int window_width;				/* window size when last rendered. */
@@ -117,6 +144,7 @@ struct _GtkXText
 
 	gint io_tag;					  /* for delayed refresh events */
 	gint add_io_tag;				  /* "" when adding new text */
+	GTimeVal last_frame;			  /* when appended text was last drawn */
 	gint scroll_tag;				  /* marking-scroll timeout */
 	gulong vc_signal_tag;        /* signal handler for "value_changed" adj */
 
@@ -140,7 +168,16 @@ struct _GtkXText
 	int hilight_start;
 	int hilight_end;
 
-	guint16 fontwidth[128];	  /* each char's width, only the ASCII ones */
+	guint16 fontwidth[256];	  /* each char's width, U+0000 to U+00FF */
+	GHashTable *fontwidth_hash;  /* widths of other chars, as they turn up */
+
+#define STAMP_CACHE 256
+	struct xtext_stamp
+	{
+		time_t stamp;
+		char *str;
+		int len;
+	} stamp_cache[STAMP_CACHE];	  /* see gtk_xtext_get_stamp() */
 
 #ifdef USE_XFT
 	XftColor color[XTEXT_COLS];
@@ -169,6 +206,7 @@ struct _GtkXText
 
 	void (*error_function) (int type);
 	int (*urlcheck_function) (GtkWidget * xtext, char *word, int len);
+	guint url_gen;					/* bumped when urlcheck_function changes */
 
 	int jump_out_offset;	/* point at which to stop rendering */
 	int jump_in_offset;	/* "" start rendering */
@@ -213,6 +251,7 @@ struct _GtkXText
 	unsigned int avoid_trans:1;
 	unsigned int overdraw:1;
 	unsigned int indent_changed:1;
+	unsigned int top_removed:1;	/* adj->value moved since the last frame */
 	unsigned int shm:1;
 };
 
@@ -249,6 +288,9 @@ void gtk_xtext_set_show_marker (GtkXText *xtext, gboolean show_marker);
 void gtk_xtext_set_show_separator (GtkXText *xtext, gboolean show_separator);
 void gtk_xtext_set_thin_separator (GtkXText *xtext, gboolean thin_separator);
 void gtk_xtext_set_time_stamp (xtext_buffer *buf, gboolean timestamp);
+/* supplied by the program: formats a timestamp into a g_malloc'd string
+   and returns its length */
+int xtext_get_stamp_str (time_t, char **);
 void gtk_xtext_set_tint (GtkXText *xtext, int tint_red, int tint_green, int tint_blue);
 void gtk_xtext_set_urlcheck_function (GtkXText *xtext, int (*urlcheck_function) (GtkWidget *, char *, int));
 void gtk_xtext_set_wordwrap (GtkXText *xtext, gboolean word_wrap);
@@ -256,6 +298,19 @@ void gtk_xtext_set_wordwrap (GtkXText *xtext, gboolean word_wrap);
 xtext_buffer *gtk_xtext_buffer_new (GtkXText *xtext);
 void gtk_xtext_buffer_free (xtext_buffer *buf);
 void gtk_xtext_buffer_show (GtkXText *xtext, xtext_buffer *buf, int render);
+
+/**
+ * The number of bytes used to store the buffer's text.
+ */
+gsize gtk_xtext_buffer_get_memory (xtext_buffer *buf);
+
+/**
+ * Keep only the newest hot_lines entries of the buffer in memory. Older
+ * ones are written to the file at path, and read back in a page at a time
+ * when the user scrolls up to them. A NULL path turns this off again, and
+ * drops whatever was in the file. Returns FALSE if path can't be opened.
+ */
+gboolean gtk_xtext_set_spill (xtext_buffer *buf, const char *path, int hot_lines);
 GtkType gtk_xtext_get_type (void);
 
 /**